@@ -32,6 +32,7 @@
  */
 
 
+#ifndef XENLOOP_USER
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
@@ -40,21 +41,25 @@
 #include <linux/skbuff.h>
 #include <linux/if_ether.h>
 #include <linux/netdevice.h>
+#include <linux/interrupt.h>
+#include <linux/moduleparam.h>
 
 #include <xen/hypercall.h>
 #include <xen/driver_util.h>
 #include <xen/gnttab.h>
 #include <xen/evtchn.h>
+#endif
 
 #include "debug.h"
 #include "xenfifo.h"
 #include "bififo.h"
 #include "maptable.h"
 
-extern HashTable mac_domid_map;
 extern wait_queue_head_t swq;
 extern struct net_device *NIC;
-extern Entry*	lookup_bfh(HashTable *, void *);
+
+/* Bytes of a large packet received into the linear part of its skb */
+#define BF_RX_PULL 128
 
 void bf_notify(int port) 
 {
@@ -80,118 +85,1000 @@ out:
 
 }
 
-static inline void copy_large_pkt(bf_data_t * mdata, struct sk_buff *skb, xf_handle_t *xfh)
+/*
+ * Maps the GSO type of a TSO super-packet to its wire bits. Returns 0 for 
+ * an ordinary packet and -1 for a GSO type the receiver cannot take, 
+ * which is then left for the stack to segment.
+ */
+static inline int bf_gso_type(struct sk_buff *skb)
 {
-	char *pback, *pfront, *pfifo;
-	int num_entries, len, len1, len2, pkt_len;
-	
+	int type = skb_shinfo(skb)->gso_type, wire;
+
+	if (!skb_shinfo(skb)->gso_size)
+		return 0;
+
+	if (type & SKB_GSO_TCPV4)
+		wire = BF_GSO_TCPV4;
+	else if (type & SKB_GSO_TCPV6)
+		wire = BF_GSO_TCPV6;
+	else
+		return -1;
+
+	if (type & SKB_GSO_TCP_ECN)
+		wire |= BF_GSO_TCP_ECN;
+	return wire;
+}
+
+/* FIFO slots skb's record takes, when sent as segs grants or copied if 0 */
+static inline uint32_t bf_tx_entries(struct sk_buff *skb, int segs)
+{
+	return BF_PKT_ENTRIES(segs ? segs*sizeof(bf_gref_t) + skb_headlen(skb) : skb->len);
+}
+
+/*
+ * Find room at back for a record of n slots that does not run past the 
+ * end of the FIFO memory, padding out the rest of it first if need be. 
+ * The padding is pushed at once, so a FIFO that then lacks room for 
+ * the record only has to drain to the end for the record to fit at its 
+ * start. Returns the record's header, or NULL if there is no room yet.
+ */
+static bf_data_t *bf_tx_reserve(xf_handle_t *xfh, uint32_t n)
+{
+	xf_descriptor_t *des = xfh->descriptor;
+	uint32_t tail = xfh->max_data_entries - (des->back & xfh->index_mask);
+	bf_data_t *pad;
+
+	if (n > tail) {
+		if (!xf_has_free(xfh, tail))
+			return NULL;
+		pad = xf_back_entry(xfh, bf_data_t, 0);
+		pad->type = BF_PAD;
+		pad->status = 0;
+		pad->pkt_info = 0;
+		xf_pushn(xfh, tail);
+	}
+
+	if (!xf_has_free(xfh, n))
+		return NULL;
+
+	return xf_back_entry(xfh, bf_data_t, 0);
+}
+
+/* Fill in the header of skb's record */
+static inline void bf_tx_header(bf_data_t *mdata, struct sk_buff *skb, uint8_t type, uint16_t status)
+{
+	mdata->status = status;
+	mdata->type = type;
+	mdata->pkt_info = skb->len; 
+	mdata->linear = 0;
+
+	if (!skb_shinfo(skb)->gso_size)
+		return;
+
+	mdata->type |= BF_PACKET_GSO;
+	mdata->gso.gso_size = skb_shinfo(skb)->gso_size;
+	mdata->gso.gso_type = bf_gso_type(skb);
+}
+
+/*
+ * The payload is copied straight out of the skb's linear part and page 
+ * fragments by skb_copy_bits, so a scatter-gather or TSO skb is never 
+ * linearized on its way into the FIFO.
+ */
+int xmit_large_pkt(struct sk_buff *skb, xf_handle_t *xfh)
+{
+	bf_data_t *mdata;
+	int num_entries, ret;
+
 	TRACE_ENTRY;
+	BUG_ON(!skb);
+	BUG_ON(!xfh);
 
-        skb_reserve(skb, 2 + ETH_HLEN);
-        skb_put(skb, mdata->pkt_info);
-	
-	pkt_len = mdata->pkt_info;
-	num_entries = pkt_len/sizeof(bf_data_t);
-	if (pkt_len % sizeof(bf_data_t)) 
-		num_entries++;
+	num_entries = bf_tx_entries(skb, 0);
+
+	mdata = bf_tx_reserve(xfh, num_entries);
+	if (!mdata) {
+		TRACE_EXIT;
+		return -1;
+	}
+
+	bf_tx_header(mdata, skb, BF_PACKET, BF_WAITING);
+
+	if(skb_copy_bits(skb, 0, mdata->data, skb->len))
+		BUG();
+
+	ret = xf_pushn(xfh, num_entries);
+	BUG_ON( ret < 0 );
+
+	TRACE_EXIT;
+
+	return 0;
+}
+
+/*
+ * Packets larger than grant_min bytes are lent to the peer by grant 
+ * instead of being copied through the FIFO, which also lets them be 
+ * larger than the FIFO.
+ */
+static int grant_min = 8192;
+module_param(grant_min, int, 0644);
+MODULE_PARM_DESC(grant_min, "Send packets larger than this by grant copy (0 never)");
+
+#define BF_SEG_PAGES(off, len) \
+	((len) ? (((off) & ~PAGE_MASK) + (len) + PAGE_SIZE - 1) >> PAGE_SHIFT : 0)
+
+/*
+ * Returns the number of bf_gref_t entries skb takes if it is to be lent 
+ * to the peer, 0 if it is to be copied through the FIFO. Only the page 
+ * fragments are lent, so a linear skb is always copied.
+ */
+static int bf_tx_grant(struct sk_buff *skb)
+{
+	skb_frag_t *frag;
+	int i, n = 0;
+
+	if (grant_min <= 0 || skb->len <= grant_min || skb->len <= BF_RX_PULL || 
+	    skb->len > MAX_SKB_FRAGS*PAGE_SIZE || skb_shinfo(skb)->frag_list)
+		return 0;
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		n += BF_SEG_PAGES(frag->page_offset, frag->size);
+	}
+
+	return (n > BF_GRANT_SEGS) ? 0 : n;
+}
+
+/* Grant the peer len bytes at offset in page, one bf_gref_t per page */
+static int bf_grant_range(bf_handle_t *bfh, struct bf_grant_tx *tx, bf_gref_t *segs, 
+			  struct page *page, unsigned int offset, unsigned int len)
+{
+	bf_gref_t *seg;
+	unsigned int size;
+	int ref;
+
+	page += offset >> PAGE_SHIFT;
+	offset &= ~PAGE_MASK;
+
+	for (; len > 0; len -= size, offset = 0, page++) {
+		size = (len > PAGE_SIZE - offset) ? PAGE_SIZE - offset : len;
+
+		ref = gnttab_grant_foreign_access(bfh->remote_domid, 
+				pfn_to_mfn(page_to_pfn(page)), 1);
+		if (ref < 0)
+			return -1;
+		tx->gref[tx->nr++] = ref;
+
+		seg = &segs[tx->nr - 1];
+		seg->gref = ref;
+		seg->offset = offset;
+		seg->size = size;
+	}
+
+	return 0;
+}
 
+static void bf_grant_free(struct bf_grant_tx *tx)
+{
+	while (tx->nr > 0)
+		gnttab_end_foreign_access(tx->gref[--tx->nr], 0);
+	if (tx->skb)
+		kfree_skb(tx->skb);
+	tx->skb = NULL;
+}
 
-	pfifo = (char *)xfh->fifo;
-	pfront = (char *)xf_entry(xfh, bf_data_t, 1);
-	pback = (char *)xf_entry(xfh, bf_data_t, num_entries);
+/*
+ * Lend skb to the peer: grant it the segs pages holding skb's fragments 
+ * and push a record of the grants, followed by skb's linear part. On 
+ * success skb stays in tx_grants until the peer has copied it. Call 
+ * with out_lock held. 
+ * Returns 0 on success, -1 if the FIFO or tx_grants is full, -2 if skb 
+ * could not be granted.
+ */
+static int xmit_grant_pkt(bf_handle_t *bfh, struct sk_buff *skb, int segs)
+{
+	struct bf_grant_tx *tx;
+	skb_frag_t *frag;
+	bf_data_t *mdata;
+	bf_gref_t *seg;
+	int num_entries, i, ret;
 
-	BUG_ON(!pfifo);
-	BUG_ON(!pfront);
-	BUG_ON(!pback);
+	TRACE_ENTRY;
 
-	if( pback >= pfront ) {
-		memcpy(skb->data, pfront, pkt_len);
+	if (bfh->tx_grant_prod - bfh->tx_grant_cons >= BF_TX_GRANTS) {
+		TRACE_EXIT;
+		return -1;
+	}
+
+	num_entries = bf_tx_entries(skb, segs);
+	mdata = bf_tx_reserve(bfh->out, num_entries);
+	if (!mdata) {
+		TRACE_EXIT;
+		return -1;
+	}
+
+	bf_tx_header(mdata, skb, BF_PACKET | BF_PACKET_GRANT, segs);
+	mdata->linear = skb_headlen(skb);
+	seg = (bf_gref_t *)mdata->data;
+	memcpy(seg + segs, skb->data, skb_headlen(skb));
+
+	tx = &bfh->tx_grants[bfh->tx_grant_prod % BF_TX_GRANTS];
+	tx->skb = NULL;
+	tx->nr = 0;
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		if (bf_grant_range(bfh, tx, seg, frag->page, frag->page_offset, frag->size))
+			goto err;
+	}
+	BUG_ON(tx->nr != segs);
+
+	tx->skb = skb;
+	tx->end = bfh->out->descriptor->back + num_entries;
+	bfh->tx_grant_prod++;
+
+	ret = xf_pushn(bfh->out, num_entries);
+	BUG_ON( ret < 0 );
+
+	TRACE_EXIT;
+	return 0;
+
+err:
+	EPRINTK("Out of grant references\n");
+	bf_grant_free(tx);
+	TRACE_ERROR;
+	return -2;
+}
+
+/*
+ * Revoke the grants of the packets the peer has copied and free them. 
+ * Call with out_lock held. Returns the number of packets still lent.
+ */
+static int bf_reclaim(bf_handle_t *bfh)
+{
+	struct bf_grant_tx *tx;
+
+	while (bfh->tx_grant_cons != bfh->tx_grant_prod) {
+		tx = &bfh->tx_grants[bfh->tx_grant_cons % BF_TX_GRANTS];
+		if (!xf_consumed(bfh->out, tx->end))
+			break;
+		bf_grant_free(tx);
+		bfh->tx_grant_cons++;
+	}
+
+	return bfh->tx_grant_prod - bfh->tx_grant_cons;
+}
+
+static void clean_grants(bf_handle_t *bfh)
+{
+	while (bfh->tx_grant_cons != bfh->tx_grant_prod)
+		bf_grant_free(&bfh->tx_grants[bfh->tx_grant_cons++ % BF_TX_GRANTS]);
+}
+
+static void enqueue(skb_queue_t *Q, struct sk_buff *skb)
+{
+	if (Q->count++ == 0) {
+		Q->head = skb;
+		Q->tail = skb;
 	} else {
+		Q->tail->next = skb;
+		Q->tail = skb;
+	}
+}
+
+static void dequeue(skb_queue_t *Q)
+{
+	if (Q->head != Q->tail)
+		Q->head = Q->head->next;
+	if (--Q->count == 0) {
+		Q->head = NULL;
+		Q->tail = NULL;
+	}
+}
 
-		len1 = (pfifo + xfh->descriptor->max_data_entries*sizeof(bf_data_t)) - pfront;
-		len = (len1 >= pkt_len) ? pkt_len : len1;
-		memcpy(skb->data,  pfront, len);
+static void clean_pending(skb_queue_t *Q) {
+	struct sk_buff *skb;
+	while (Q->count > 0) {
+		skb = Q->head;
+		dequeue(Q);
+		kfree_skb(skb);
+	}
+}
+
+/*
+ * Packets a peer may have waiting for room in its FIFO. Beyond that the 
+ * peer is not keeping up and new packets to it are dropped, so that it 
+ * cannot pin an unbounded amount of memory.
+ */
+static int tx_queue_len = 1024;
+module_param(tx_queue_len, int, 0644);
+MODULE_PARM_DESC(tx_queue_len, "Packets queued per peer while its FIFO is full");
+
+/*
+ * Entries to wait for when the FIFO is full: room for the packet at the 
+ * head of the queue, and at least half the FIFO so that one notification 
+ * is worth a batch of packets.
+ */
+static inline uint32_t bf_tx_wake_entries(bf_handle_t *bfh, struct sk_buff *skb, int segs)
+{
+	xf_descriptor_t *des = bfh->out->descriptor;
+	uint32_t n = bf_tx_entries(skb, segs);
+	uint32_t tail = bfh->out->max_data_entries - (des->back & bfh->out->index_mask);
+	uint32_t half = bfh->out->max_data_entries/2;
+
+	/* Room for the padding comes first */
+	if (n > tail)
+		n = tail;
+	return n > half ? n : half;
+}
+
+/*
+ * The packet at the head of the queue did not fit. Ask the peer to 
+ * notify us once it might: when it has copied the oldest packet lent to 
+ * it if tx_grants is full, when the FIFO has room otherwise. 
+ * Returns non-zero if that has already happened and the caller should retry.
+ */
+static int bf_tx_wait(bf_handle_t *bfh, struct sk_buff *skb, int segs)
+{
+	struct bf_grant_tx *tx;
+
+	if (segs && bfh->tx_grant_prod - bfh->tx_grant_cons >= BF_TX_GRANTS) {
+		tx = &bfh->tx_grants[bfh->tx_grant_cons % BF_TX_GRANTS];
+		if (!xf_request_front(bfh->out, tx->end))
+			return 0;
+		bf_reclaim(bfh);
+		return 1;
+	}
+
+	bfh->tx_full++;
+	return xf_request_space(bfh->out, bf_tx_wake_entries(bfh, skb, segs));
+}
 
-		len2 = pkt_len - len;
-		if (len2 > 0) {
-			memcpy(skb->data + len, pfifo, len2);
+/*
+ * Notification coalescing. Once the peer waits for packets, the 
+ * notification that wakes it can be held back until tx_coalesce_pkts 
+ * packets have been pushed or tx_coalesce_usecs have passed, so that a 
+ * flood of small packets costs the peer one interrupt per batch rather 
+ * than one per burst of a few. The time limit is checked as packets are 
+ * sent, and by a timer, with jiffy resolution, once they stop. A full 
+ * FIFO is never held back. 
+ * tx_coalesce=2 coalesces only on the channels that send more than 
+ * tx_coalesce_rate packets a second, and stops below half that rate, 
+ * so that sparse request/response traffic is not delayed.
+ */
+static int tx_coalesce = 0;
+module_param(tx_coalesce, int, 0644);
+MODULE_PARM_DESC(tx_coalesce, "Coalesce notifications to the peer: 0 never, 1 always, 2 by packet rate");
+
+static int tx_coalesce_pkts = 16;
+module_param(tx_coalesce_pkts, int, 0644);
+MODULE_PARM_DESC(tx_coalesce_pkts, "Packets to send before a held notification goes out");
+
+static int tx_coalesce_usecs = 50;
+module_param(tx_coalesce_usecs, int, 0644);
+MODULE_PARM_DESC(tx_coalesce_usecs, "Microseconds before a held notification goes out");
+
+static int tx_coalesce_rate = 20000;
+module_param(tx_coalesce_rate, int, 0644);
+MODULE_PARM_DESC(tx_coalesce_rate, "Packets a second above which tx_coalesce=2 coalesces");
+
+#define BF_RATE_INTERVAL (HZ/10)
+
+/* Should this channel hold notifications back? Call with out_lock held. */
+static int bf_tx_coalesce(bf_handle_t *bfh)
+{
+	unsigned long pps;
+
+	if (tx_coalesce != 2)
+		return tx_coalesce == 1;
+
+	if (time_after_eq(jiffies, bfh->tx_rate_stamp + BF_RATE_INTERVAL)) {
+		pps = bfh->tx_rate_packets*HZ/(jiffies - bfh->tx_rate_stamp);
+		if (pps > tx_coalesce_rate)
+			bfh->tx_coalesce = 1;
+		else if (pps < tx_coalesce_rate/2)
+			bfh->tx_coalesce = 0;
+		bfh->tx_rate_stamp = jiffies;
+		bfh->tx_rate_packets = 0;
+	}
+	return bfh->tx_coalesce;
+}
+
+/*
+ * Notify the peer of the sent packets just pushed into the out FIFO if 
+ * it waits for them, or hold the notification back. Call with out_lock 
+ * held.
+ */
+static void bf_tx_notify(bf_handle_t *bfh, int sent)
+{
+	int coalesce;
+
+	bfh->tx_rate_packets += sent;
+	coalesce = bf_tx_coalesce(bfh);
+
+	if (xf_check_notify(bfh->out) && !bfh->tx_held) {
+		bfh->tx_held = 1;
+		bfh->tx_held_pkts = 0;
+		bfh->tx_held_since = get_cycles();
+	}
+	if (!bfh->tx_held)
+		return;
+
+	bfh->tx_held_pkts += sent;
+	if (coalesce && bfh->tx_held_pkts < tx_coalesce_pkts && !bfh->out_queue.count &&
+	    (long long)(get_cycles() - bfh->tx_held_since) < 
+			(long long)tx_coalesce_usecs*(cpu_khz/1000)) {
+		if (!timer_pending(&bfh->tx_timer))
+			mod_timer(&bfh->tx_timer, jiffies + usecs_to_jiffies(tx_coalesce_usecs));
+		return;
+	}
+
+	bfh->tx_held = 0;
+	bf_notify(bfh->port);
+}
+
+static void bf_tx_timeout(unsigned long data)
+{
+	bf_handle_t *bfh = (bf_handle_t *)data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bfh->out_lock, flags);
+	if (bfh->tx_held) {
+		bfh->tx_held = 0;
+		bf_notify(bfh->port);
+	}
+	spin_unlock_irqrestore(&bfh->out_lock, flags);
+}
+
+/*
+ * Push queued packets into the out FIFO until it is full, then ask the 
+ * peer to notify us when it has room again. Packets lent to the peer are 
+ * freed as it copies them; the peer is asked to notify us once it has 
+ * copied the last of them. Call with out_lock held.
+ */
+static void bf_drain(bf_handle_t *bfh)
+{
+	struct sk_buff *skb;
+	int sent = 0, segs, ret;
+
+	bf_reclaim(bfh);
+
+	while (bfh->out_queue.count > 0) {
+		skb = bfh->out_queue.head;
+		BUG_ON(!skb);
+
+		segs = bf_tx_grant(skb);
+		if (segs)
+			ret = xmit_grant_pkt(bfh, skb, segs);
+		else if (bf_tx_entries(skb, 0) >= bfh->out->max_data_entries)
+			ret = -2;	/* grant_min was raised after bf_xmit */
+		else
+			ret = xmit_large_pkt(skb, bfh->out);
+
+		if (ret == -1) {
+			if (bf_tx_wait(bfh, skb, segs))
+				continue;
+			break;
 		}
+
+		dequeue(&bfh->out_queue);
+		if (ret < 0)
+			bfh->tx_dropped++;
+		else
+			sent++;
+		if (ret < 0 || !segs)
+			kfree_skb(skb);
+	}
+
+	/* Padding alone also needs the peer to see it */
+	bfh->tx_packets += sent;
+	bf_tx_notify(bfh, sent);
+
+	while (!bfh->out_queue.count && bfh->tx_grant_cons != bfh->tx_grant_prod &&
+	       xf_request_front(bfh->out, 
+			bfh->tx_grants[(bfh->tx_grant_prod - 1) % BF_TX_GRANTS].end))
+		bf_reclaim(bfh);
+}
+
+/*
+ * Queue skb behind the packets already waiting for this peer and push as 
+ * many of them into the out FIFO as fit. If the peer already has 
+ * tx_queue_len packets waiting, skb is dropped. 
+ * Returns the number of packets left waiting, or -1 if skb can neither 
+ * fit in the FIFO nor be lent to the peer, or is of a GSO type the peer 
+ * cannot take, in which case the caller keeps it.
+ */
+int bf_xmit(bf_handle_t *bfh, struct sk_buff *skb)
+{
+	unsigned long flags;
+	int ret;
+
+	TRACE_ENTRY;
+	BUG_ON(!skb);
+
+	if( bf_tx_entries(skb, bf_tx_grant(skb)) >= bfh->out->max_data_entries ) {
+		DB("Packet size greater than total fifo size\n");
+		TRACE_EXIT;
+		return -1;
 	}
 
+	if( bf_gso_type(skb) < 0 ) {
+		DB("GSO type %x not supported\n", skb_shinfo(skb)->gso_type);
+		TRACE_EXIT;
+		return -1;
+	}
+
+	spin_lock_irqsave(&bfh->out_lock, flags);
+
+	if (bfh->out_queue.count < tx_queue_len) {
+		enqueue(&bfh->out_queue, skb);
+	} else {
+		bfh->tx_dropped++;
+		kfree_skb(skb);
+	}
+
+	bf_drain(bfh);
+
+	ret = bfh->out_queue.count;
+
+	spin_unlock_irqrestore(&bfh->out_lock, flags);
+
+	TRACE_EXIT;
+	return ret;
+}
+
+/*
+ * Retry the packets waiting for this peer, once it has signalled that 
+ * its FIFO has room. Returns the number still waiting.
+ */
+int bf_xmit_pending(bf_handle_t *bfh)
+{
+	unsigned long flags;
+	int ret;
+
+	TRACE_ENTRY;
+
+	spin_lock_irqsave(&bfh->out_lock, flags);
+	bf_drain(bfh);
+	ret = bfh->out_queue.count;
+	spin_unlock_irqrestore(&bfh->out_lock, flags);
+
+	TRACE_EXIT;
+	return ret;
+}
+
+static inline void bf_rx_setup(struct sk_buff *skb, bf_data_t *mdata, int type)
+{
         skb->mac.raw = skb->data - ETH_HLEN; 
         skb->ip_summed = CHECKSUM_UNNECESSARY;
         skb->pkt_type = PACKET_HOST;
         skb->protocol = htons(ETH_P_IP);
         skb->dev = NIC;
+
+	/* 
+	 * Keep a super-packet whole, as netfront does. The stack segments it 
+	 * again should it ever be forwarded to a real device; DODGY makes it 
+	 * check the headers first.
+	 */
+	if (type & BF_PACKET_GSO) {
+		int gso_type = XF_READ_ONCE(mdata->gso.gso_type);
+
+		skb_shinfo(skb)->gso_size = XF_READ_ONCE(mdata->gso.gso_size);
+		skb_shinfo(skb)->gso_type = SKB_GSO_DODGY |
+			((gso_type & BF_GSO_TCPV6) ? SKB_GSO_TCPV6 : SKB_GSO_TCPV4) |
+			((gso_type & BF_GSO_TCP_ECN) ? SKB_GSO_TCP_ECN : 0);
+		skb_shinfo(skb)->gso_segs = 0;
+	}
+}
+
+static inline void copy_large_pkt(bf_data_t * mdata, struct sk_buff *skb, uint32_t len, int type)
+{
+	TRACE_ENTRY;
+
+        skb_reserve(skb, 2 + ETH_HLEN);
+	memcpy(skb_put(skb, len), mdata->data, len);
+
         skb_shinfo(skb)->nr_frags = 0;
         skb_shinfo(skb)->frag_list = NULL;
         skb_shinfo(skb)->frags[0].page = NULL;
+	bf_rx_setup(skb, mdata, type);
 
 	TRACE_EXIT;
 }
 
-static inline struct sk_buff * copy_packet(xf_handle_t * xfh)
+/*
+ * Large packets are received into page fragments, with only the first 
+ * BF_RX_PULL bytes, enough for the headers, in the linear part. The 
+ * data is still copied once out of the FIFO, but a 64KB packet then takes 
+ * order-0 pages instead of a 128KB kmalloc from atomic context, and its 
+ * truesize, which socket buffer accounting is based on, stays honest.
+ */
+static int rx_frag_min = 2048;
+module_param(rx_frag_min, int, 0644);
+MODULE_PARM_DESC(rx_frag_min, "Receive packets larger than this into page fragments");
+
+static struct sk_buff *frag_packet(bf_data_t *mdata, uint32_t pkt_len, int type)
+{
+	struct sk_buff *skb;
+	struct page *page;
+	char *src = (char *)mdata->data;
+	int len = pkt_len - BF_RX_PULL, size, i;
+
+	TRACE_ENTRY;
+
+	skb = alloc_skb(BF_RX_PULL + 2 + ETH_HLEN, GFP_ATOMIC);
+	if (!skb)
+		goto err;
+	skb_reserve(skb, 2 + ETH_HLEN);
+	memcpy(skb_put(skb, BF_RX_PULL), src, BF_RX_PULL);
+	src += BF_RX_PULL;
+
+	for (i = 0; len > 0; i++, len -= size) {
+		size = (len > PAGE_SIZE) ? PAGE_SIZE : len;
+		page = alloc_page(GFP_ATOMIC);
+		if (!page) {
+			kfree_skb(skb);
+			goto err;
+		}
+		memcpy(page_address(page), src, size);
+		src += size;
+		skb_fill_page_desc(skb, i, page, 0, size);
+		skb->len += size;
+		skb->data_len += size;
+		skb->truesize += PAGE_SIZE;
+	}
+
+	bf_rx_setup(skb, mdata, type);
+
+	TRACE_EXIT;
+	return skb;
+err:
+	DB("Cannot allocate skb for size %d\n", pkt_len);
+	TRACE_ERROR;
+	return NULL;
+}
+
+/* The fragment that byte len of a packet being received into pages goes to */
+static inline skb_frag_t *bf_rx_frag(struct sk_buff *skb, int len)
 {
+	struct page *page;
+
+	if (!(len & ~PAGE_MASK)) {
+		page = alloc_page(GFP_ATOMIC);
+		if (!page)
+			return NULL;
+		skb_fill_page_desc(skb, skb_shinfo(skb)->nr_frags, page, 0, 0);
+		skb->truesize += PAGE_SIZE;
+	}
+	return &skb_shinfo(skb)->frags[skb_shinfo(skb)->nr_frags - 1];
+}
+
+/*
+ * Copy a packet lent by the peer into page fragments as frag_packet 
+ * does: its linear bytes out of the record, then its pieces out of the 
+ * peer's pages with GNTTABOP_copy. Everything in the record comes from 
+ * the peer, and it can still rewrite it, so each piece is read once and 
+ * checked before it reaches the hypervisor; nr, pkt_len and linear are 
+ * the caller's copies of the header.
+ */
+static struct sk_buff *grant_packet(bf_handle_t *bfh, bf_data_t *mdata, 
+				    int nr, uint32_t pkt_len, uint32_t linear, int type)
+{
+	gnttab_copy_t *op = bfh->rx_copy;
+	struct sk_buff *skb;
+	skb_frag_t *frag;
+	bf_gref_t *segs = (bf_gref_t *)mdata->data, seg;
+	char *src = (char *)(segs + nr);
+	int len = 0, done, size, i, ret;
+
+	TRACE_ENTRY;
+
+	if (nr > BF_GRANT_SEGS || pkt_len <= BF_RX_PULL || pkt_len > MAX_SKB_FRAGS*PAGE_SIZE || 
+	    linear > pkt_len) {
+		EPRINTK("Bad granted packet: %u bytes in %d pieces and %u inline\n", pkt_len, nr, linear);
+		goto err;
+	}
+
+	skb = alloc_skb(BF_RX_PULL + 2 + ETH_HLEN, GFP_ATOMIC);
+	if (!skb)
+		goto err;
+	skb_reserve(skb, 2 + ETH_HLEN);
+
+	for (; len < linear; len += size, src += size) {
+		if (!(frag = bf_rx_frag(skb, len)))
+			goto drop;
+		size = linear - len;
+		if (size > PAGE_SIZE - frag->size)
+			size = PAGE_SIZE - frag->size;
+		memcpy((char *)page_address(frag->page) + frag->size, src, size);
+		frag->size += size;
+	}
+
+	for (i = 0; i < nr; i++) {
+		seg.gref = XF_READ_ONCE(segs[i].gref);
+		seg.offset = XF_READ_ONCE(segs[i].offset);
+		seg.size = XF_READ_ONCE(segs[i].size);
+		if (seg.offset + seg.size > PAGE_SIZE || len + seg.size > pkt_len)
+			goto drop;
+
+		for (done = 0; done < seg.size; done += size, len += size, op++) {
+			if (!(frag = bf_rx_frag(skb, len)))
+				goto drop;
+			size = seg.size - done;
+			if (size > PAGE_SIZE - frag->size)
+				size = PAGE_SIZE - frag->size;
+
+			op->source.u.ref = seg.gref;
+			op->source.domid = bfh->remote_domid;
+			op->source.offset = seg.offset + done;
+			op->dest.u.gmfn = virt_to_mfn(page_address(frag->page));
+			op->dest.domid = DOMID_SELF;
+			op->dest.offset = frag->size;
+			op->len = size;
+			op->flags = GNTCOPY_source_gref;
+			frag->size += size;
+		}
+	}
+
+	if (len != pkt_len)
+		goto drop;
+
+	ret = HYPERVISOR_grant_table_op(GNTTABOP_copy, bfh->rx_copy, op - bfh->rx_copy);
+	if (ret) {
+		EPRINTK("GNTTABOP_copy failed ret = %d\n", ret);
+		goto drop;
+	}
+	for (i = 0; i < op - bfh->rx_copy; i++)
+		if (bfh->rx_copy[i].status != GNTST_okay) {
+			EPRINTK("GNTTABOP_copy failed status = %d\n", bfh->rx_copy[i].status);
+			goto drop;
+		}
+
+	/* Pull the headers into the linear part */
+	frag = &skb_shinfo(skb)->frags[0];
+	memcpy(skb_put(skb, BF_RX_PULL), page_address(frag->page), BF_RX_PULL);
+	frag->page_offset += BF_RX_PULL;
+	frag->size -= BF_RX_PULL;
+	skb->len += len - BF_RX_PULL;
+	skb->data_len += len - BF_RX_PULL;
+
+	bf_rx_setup(skb, mdata, type);
+
+	TRACE_EXIT;
+	return skb;
+
+drop:
+	kfree_skb(skb);
+err:
+	TRACE_ERROR;
+	return NULL;
+}
+
+/*
+ * Copy out the record at off entries past front, of which avail can be 
+ * read, and set *n to the entries it takes. Returns the packet, or 
+ * NULL if the record is padding or the packet was dropped.
+ */
+static inline struct sk_buff * copy_packet(bf_handle_t *bfh, uint32_t off, uint32_t avail, uint32_t *n)
+{
+	xf_handle_t *xfh = bfh->in;
+	xf_descriptor_t *des = xfh->descriptor;
+	uint32_t tail = xfh->max_data_entries - ((des->front + off) & xfh->index_mask);
 	struct sk_buff *skb = NULL;
 	bf_data_t * data;
-	int n, ret;
+	uint32_t len, linear;
+	int type, status;
 
 	TRACE_ENTRY;
 
-	data = xf_front(xfh, bf_data_t);
-	BUG_ON(!data);
+	/* The peer can rewrite the record under us: use only these copies */
+	data = xf_entry(xfh, bf_data_t, off);
+	type = XF_READ_ONCE(data->type);
+	status = XF_READ_ONCE(data->status);
+	len = XF_READ_ONCE(data->pkt_info);
+	linear = XF_READ_ONCE(data->linear);
+
+	/* len and linear are bounded first so that a huge one cannot wrap the sum */
+	if (type & BF_PAD)
+		*n = tail;
+	else if (type & BF_PACKET_GRANT)
+		*n = (linear <= tail*sizeof(bf_data_t)) ? 
+			BF_PKT_ENTRIES(status*sizeof(bf_gref_t) + linear) : tail + 1;
+	else
+		*n = (len <= tail*sizeof(bf_data_t)) ? BF_PKT_ENTRIES(len) : tail + 1;
+
+	/* 
+	 * The producer pushes whole records that end at the end of the FIFO 
+	 * memory at the latest, so this one is corrupt: drop what is left
+	 */
+	if (*n > tail || *n > avail - off) {
+		EPRINTK("Record of %u slots runs past the end of the FIFO or of the data\n", *n);
+		*n = min(tail, avail - off);
+		goto out;
+	}
+
+	if (type & BF_PAD)
+		goto out;
+
+	if (type & BF_PACKET_GRANT) {
+		skb = grant_packet(bfh, data, status, len, linear, type);
+		goto out;
+	}
+
+	/* 
+	 * If there is no memory the packet is dropped, like a NIC would. 
+	 * Leaving it in the FIFO would stall the channel, since the 
+	 * producer only notifies us of new packets.
+	 */
+	if (len > rx_frag_min && len > BF_RX_PULL &&
+	    len - BF_RX_PULL <= MAX_SKB_FRAGS*PAGE_SIZE) {
+		skb = frag_packet(data, len, type);
+		goto out;
+	}
 
-        skb = alloc_skb(data->pkt_info + 2 + ETH_HLEN, GFP_ATOMIC);
+        skb = alloc_skb(len + 2 + ETH_HLEN, GFP_ATOMIC);
         if (!skb) {
-		DB("Cannot allocate skb for size %d\n", data->pkt_info + 2 + ETH_HLEN);
+		DB("Cannot allocate skb for size %d\n", len + 2 + ETH_HLEN);
                 goto out;
 	}
 
-	copy_large_pkt(data, skb, xfh);
+	copy_large_pkt(data, skb, len, type);
 
-	n = data->pkt_info/sizeof(bf_data_t) + 1;
-	if (data->pkt_info % sizeof(bf_data_t)) 
-		n++;
-
-	ret = xf_popn(xfh, n);
-	BUG_ON( ret < 0 );
-	
 out:
 	TRACE_EXIT;
 	return skb;
 }
 
-void recv_packets(bf_handle_t *bfh)
+/*
+ * Receive up to budget records from the in FIFO and hand the packets to 
+ * the stack. The batch is read against one snapshot of back and released 
+ * with one update of front, before the packets go up the stack, so that 
+ * the producer can refill the FIFO meanwhile.
+ * Called only from the channel's rx tasklet, which never runs on two CPUs 
+ * at once, so the consumer side needs no lock.
+ * Returns the number of records taken off the FIFO.
+ */
+int recv_packets(bf_handle_t *bfh, int budget)
 {
-	static DEFINE_SPINLOCK(recv_lock);
-	struct sk_buff *skb;
-	unsigned long flags;
+	struct sk_buff *skb, *head = NULL, **tail = &head;
+	uint32_t avail, off = 0, n;
+	int work = 0, ret;
 
 	TRACE_ENTRY;
 
-	spin_lock_irqsave(&recv_lock, flags); 
-
-	while( !xf_empty(bfh->in) ) {
+	avail = xf_front_batch(bfh->in);
 
-		skb = copy_packet(bfh->in);
+	for (; work < budget && off < avail; work++, off += n) {
+		skb = copy_packet(bfh, off, avail, &n);
 		if (!skb)
+			continue;
+		*tail = skb;
+		tail = &skb->next;
+	}
+	*tail = NULL;
+
+	if (off) {
+		ret = xf_popn(bfh->in, off);
+		BUG_ON( ret < 0 );
+	}
+
+	while ((skb = head)) {
+		head = skb->next;
+		skb->next = NULL;
+		netif_receive_skb(skb);
+	}
+	if (work)
+		NIC->last_rx = jiffies;
+
+	bfh->rx_packets += work;
+	if (work && xf_check_space_notify(bfh->in))
+		bf_notify(bfh->port);
+
+	TRACE_EXIT;
+	return work;
+}
+
+/*
+ * Maximum number of packets received per channel in one pass of bf_poll 
+ * before other softirq work gets a turn
+ */
+static int rx_budget = 64;
+module_param(rx_budget, int, 0644);
+MODULE_PARM_DESC(rx_budget, "Packets received per channel per poll pass");
+
+/*
+ * Busy polling. Instead of waiting for an interrupt as soon as its in 
+ * FIFO runs dry, the rx tasklet of a channel to one of busy_poll_peers 
+ * (any peer if none are given) spins on it for up to busy_poll 
+ * microseconds. Until it gives up it leaves back_event behind, which 
+ * tells the peer that we are polling, so the peer sends no notification 
+ * and a packet costs no event channel round trip. The price is the CPU 
+ * that spins.
+ */
+static int busy_poll = 0;
+module_param(busy_poll, int, 0644);
+MODULE_PARM_DESC(busy_poll, "Microseconds to poll an empty FIFO before waiting for an interrupt (0 off)");
+
+static int busy_poll_peers[16];
+static int nr_busy_poll_peers;
+module_param_array(busy_poll_peers, int, &nr_busy_poll_peers, 0644);
+MODULE_PARM_DESC(busy_poll_peers, "Domain ids of the peers to busy poll (default all)");
+
+/*
+ * Spin until the in FIFO has data or the budget runs out. Returns 
+ * non-zero if there is data. Gives up early on a transmit backlog, 
+ * which waits for a notification from the peer that we would not see 
+ * with the event channel masked.
+ */
+static int bf_busy_poll(bf_handle_t *bfh)
+{
+	cycles_t end;
+	int i;
+
+	if (busy_poll <= 0)
+		return 0;
+
+	for (i = 0; i < nr_busy_poll_peers; i++)
+		if (busy_poll_peers[i] == bfh->remote_domid)
 			break;
+	if (nr_busy_poll_peers && i == nr_busy_poll_peers)
+		return 0;
+
+	end = get_cycles() + (cycles_t)busy_poll*(cpu_khz/1000);
+	do {
+		if (!xf_empty(bfh->in))
+			return 1;
+		if (bfh->out_queue.count > 0 || bfh->tx_grant_cons != bfh->tx_grant_prod)
+			return 0;
+		cpu_relax();
+	} while ((long long)(get_cycles() - end) < 0);
 
-		spin_unlock_irqrestore(&recv_lock, flags);
+	return 0;
+}
 
-		netif_rx(skb);
+/*
+ * Softirq half of the event channel handler, much like a NAPI poll 
+ * routine. The peer signals both new packets in our in FIFO and room in 
+ * our out FIFO, so retry any transmit backlog, and free the packets it 
+ * has copied, first. 
+ * The event channel stays masked while there is receive work left, or 
+ * while we busy poll; it is unmasked only once the FIFO is empty and the 
+ * producer has been asked to notify us of the next packet.
+ */
+static void bf_poll(unsigned long data)
+{
+	bf_handle_t *bfh = (bf_handle_t *)data;
 
-		NIC->last_rx = jiffies;
+	TRACE_ENTRY;
+
+	if (bfh->out_queue.count > 0 || bfh->tx_grant_cons != bfh->tx_grant_prod)
+		bf_xmit_pending(bfh);
 
-		spin_lock_irqsave(&recv_lock, flags); 
+	/* The peer is close to filling the FIFO: a hint to make it deeper */
+	if (xf_size(bfh->in) >= bfh->in->max_data_entries/4*3)
+		bfh->rx_full++;
+
+	if( recv_packets(bfh, rx_budget) >= rx_budget || bf_busy_poll(bfh) || 
+			xf_enable_notify(bfh->in) ) {
+		tasklet_schedule(&bfh->rx_tasklet);
+		TRACE_EXIT;
+		return;
 	}
 
-	spin_unlock_irqrestore(&recv_lock, flags);
+	unmask_evtchn(bfh->port);
 
 	TRACE_EXIT;
 }
 
-
+/*
+ * Is the channel quiet in our direction: nothing waiting, nothing lent 
+ * to the peer, nothing in either FIFO?
+ */
+int bf_idle(bf_handle_t *bfh)
+{
+	return !bfh->out_queue.count && bfh->tx_grant_cons == bfh->tx_grant_prod && 
+		!xf_size(bfh->out) && !xf_size(bfh->in);
+}
 
 irqreturn_t bf_callback(int rq, void *dev_id, struct pt_regs *regs)
 {
@@ -202,17 +1089,17 @@ irqreturn_t bf_callback(int rq, void *dev_id, struct pt_regs *regs)
 	BUG_ON(!check_descriptor(bfh));
 
 	if (BF_SUSPEND_IN(bfh) || BF_SUSPEND_OUT(bfh)) {
-		Entry *e = lookup_bfh(&mac_domid_map, bfh);
-		BUG_ON(!e);
-
-		e->status = XENLOOP_STATUS_SUSPEND;
+		/* The entry outlives its channels, which unbind us first */
+		if (bfh->entry)
+			bfh->entry->status = XENLOOP_STATUS_SUSPEND;
 
 		wake_up_interruptible(&swq);
 		TRACE_EXIT;
 		return IRQ_HANDLED;
 	}
 
-	recv_packets(bfh);
+	mask_evtchn(bfh->port);
+	tasklet_schedule(&bfh->rx_tasklet);
 	
 	TRACE_EXIT;
 	return IRQ_HANDLED;
@@ -282,6 +1169,14 @@ out:
 	return -1;
 }
 
+/*
+ * Does the connector still map either FIFO of the listener bfl?
+ */
+int bf_mapped(bf_handle_t *bfl)
+{
+	return xf_mapped(bfl->in) || xf_mapped(bfl->out);
+}
+
 void bf_destroy(bf_handle_t *bfl)
 {
 	TRACE_ENTRY;
@@ -291,14 +1186,21 @@ void bf_destroy(bf_handle_t *bfl)
 		goto err;
 	}
 
+	/* Nothing may touch the port once it is closed and can be reused */
+	if(bfl->irq)
+		unbind_from_irqhandler(bfl->irq, (void *)bfl);
+	tasklet_kill(&bfl->rx_tasklet);
+	del_timer_sync(&bfl->tx_timer);
+	free_evtch(bfl->port, 0, (void *)bfl);
+	clean_pending(&bfl->out_queue);
+	clean_grants(bfl);
+
 	if(bfl->in) 
 		xf_destroy(bfl->in);
 
 	if(bfl->out) 
 		xf_destroy(bfl->out);
 
-	free_evtch(bfl->port, bfl->irq, (void *)bfl);
-
 	kfree(bfl);
 
 	TRACE_EXIT;
@@ -321,6 +1223,12 @@ bf_handle_t *bf_create(domid_t rdomid, int entry_order)
 	}
 
 	memset(bfl, 0, sizeof(bf_handle_t));
+	tasklet_init(&bfl->rx_tasklet, bf_poll, (unsigned long)bfl);
+	init_timer(&bfl->tx_timer);
+	bfl->tx_timer.function = bf_tx_timeout;
+	bfl->tx_timer.data = (unsigned long)bfl;
+	bfl->tx_rate_stamp = jiffies;
+	spin_lock_init(&bfl->out_lock);
 	bfl->remote_domid = rdomid;
 	bfl->out = xf_create(rdomid, sizeof(bf_data_t), entry_order);
 	bfl->in = xf_create(rdomid, sizeof(bf_data_t), entry_order);
@@ -393,14 +1301,21 @@ void bf_disconnect(bf_handle_t *bfc)
 		goto err;
 	}
 
+	/* Nothing may touch the port once it is closed and can be reused */
+	if(bfc->irq)
+		unbind_from_irqhandler(bfc->irq, (void *)bfc);
+	tasklet_kill(&bfc->rx_tasklet);
+	del_timer_sync(&bfc->tx_timer);
+	free_evtch(bfc->port, 0, (void *)bfc);
+	clean_pending(&bfc->out_queue);
+	clean_grants(bfc);
+
 	if(bfc->in) 
 		xf_disconnect(bfc->in);
 
 	if(bfc->out) 
 		xf_disconnect(bfc->out);
 
-	free_evtch(bfc->port, bfc->irq, (void *)bfc);
-
 	kfree(bfc);
 
 	TRACE_EXIT;
@@ -423,9 +1338,15 @@ bf_handle_t *bf_connect(domid_t rdomid, int rgref_in, int rgref_out, int rport)
 	}
 
 	memset(bfc, 0, sizeof(bf_handle_t));
+	tasklet_init(&bfc->rx_tasklet, bf_poll, (unsigned long)bfc);
+	init_timer(&bfc->tx_timer);
+	bfc->tx_timer.function = bf_tx_timeout;
+	bfc->tx_timer.data = (unsigned long)bfc;
+	bfc->tx_rate_stamp = jiffies;
+	spin_lock_init(&bfc->out_lock);
 	bfc->remote_domid = rdomid;
-	bfc->out = xf_connect(rdomid, rgref_out);
-	bfc->in = xf_connect(rdomid, rgref_in);
+	bfc->out = xf_connect(rdomid, rgref_out, sizeof(bf_data_t));
+	bfc->in = xf_connect(rdomid, rgref_in, sizeof(bf_data_t));
 	if(!bfc->out || !bfc->in) {
 		EPRINTK("Can't allocate bfc->in %p or bfc->out %p\n", bfc->in, bfc->out);
 		goto err;
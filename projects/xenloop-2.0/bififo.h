@@ -37,30 +37,136 @@
 
 #include "xenfifo.h"
 
+#ifndef XENLOOP_USER
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+#include <linux/skbuff.h>
+#include <linux/timer.h>
+#include <asm/timex.h>
+#endif
+
 #define BF_PACKET 0
 #define BF_RESPONSE 1
 
+/* Flags in the type of a BF_PACKET header */
+#define BF_PACKET_GSO 2	/* gso is valid */
+#define BF_PACKET_GRANT 4	/* payload is granted, see bf_gref_t */
+
+/* Padding from here to the end of the FIFO memory; the next record is at its start */
+#define BF_PAD 8
+
 #define BF_WAITING 0
 #define BF_PROCESSING 1
 #define BF_FREE 2
 
+/* FIFO entries are 64 byte slots */
+#define BF_SLOT_SHIFT 6
+
+#define XENLOOP_ENTRY_ORDER 12 	/* 256KB */
+#define XENLOOP_MIN_ENTRY_ORDER 5 	/* room for a 1500 byte packet */
+#define XENLOOP_MAX_ENTRY_ORDER (MAX_FIFO_PAGE_ORDER + PAGE_SHIFT - BF_SLOT_SHIFT)
+#define XENLOOP_MAX_QUEUES 8
+
+/* 
+ * A TSO/GSO super-packet crosses the FIFO whole; this tells the receiver 
+ * how to segment it should it ever need to.
+ */
+#define BF_GSO_TCPV4	1
+#define BF_GSO_TCPV6	2
+#define BF_GSO_TCP_ECN	4
+
+struct bf_gso {
+	uint16_t gso_size;
+	uint16_t gso_type;
+};
+typedef struct bf_gso bf_gso_t;
+
 /* 
  * No pointers please since the data is copied into FIFO for the other domain to pick up. 
- * Try to keep the sizeof(bf_data_t) a power of 2 since it has to fit within 2^page_order
+ *
+ * A record starts on a slot with this header and takes as many whole 
+ * slots as its header and payload need. The payload starts in data and 
+ * runs on into the following slots, but never past the end of the FIFO 
+ * memory: a record that would is put at the start of the FIFO, after a 
+ * BF_PAD record that fills the rest. So the payload is always one 
+ * contiguous buffer.
  */
 struct bf_data {
 	uint8_t type;	  
 	uint16_t status;  
-	uint32_t pkt_info; 
+	uint32_t pkt_info; /* payload bytes */
+	bf_gso_t gso;
+	uint32_t linear; /* grant records: packet bytes inline after the pieces */
+	uint8_t data[(1 << BF_SLOT_SHIFT) - 16];
 };
 typedef struct bf_data bf_data_t;
 
+/*
+ * Large packets are not copied through the FIFO. The sender grants the 
+ * peer read access to the pages of the packet's fragments and sends one 
+ * bf_gref_t per page-sized piece of them in place of the data, with 
+ * their number in the header's status. The linear part of the packet 
+ * shares its page with other kmalloc objects, which must not be granted, 
+ * so its linear bytes follow the pieces inline. The peer copies the 
+ * pieces with GNTTABOP_copy before it pops the record, so once front 
+ * has passed the record the sender can revoke the grants and free the 
+ * packet.
+ */
+struct bf_gref {
+	uint32_t gref;
+	uint16_t offset;
+	uint16_t size;
+};
+typedef struct bf_gref bf_gref_t;
+
+#define BF_GRANT_SEGS (2*MAX_SKB_FRAGS)	/* pieces per packet */
+#define BF_GRANT_COPIES (BF_GRANT_SEGS + MAX_SKB_FRAGS)	/* copy ops per packet */
+#define BF_TX_GRANTS 32	/* packets in flight per peer */
+
+/* Slots taken by a record with len bytes of payload */
+#define BF_PKT_ENTRIES(len) \
+	((offsetof(bf_data_t, data) + (len) + sizeof(bf_data_t) - 1)/sizeof(bf_data_t))
+
+/* A packet lent to the peer until its front passes end */
+struct bf_grant_tx {
+	struct sk_buff *skb;
+	uint32_t end;
+	int nr;
+	grant_ref_t gref[BF_GRANT_SEGS];
+};
+
+typedef struct skb_queue{
+        struct sk_buff *head;
+        struct sk_buff *tail;
+        int count;
+} skb_queue_t;
+
+/*
+ * out_lock serializes the producer side of out together with out_queue, 
+ * the packets waiting for room in it. The consumer side of in needs no 
+ * lock since only rx_tasklet touches it.
+ */
 struct bf_handle {
+	struct Entry *entry; /* the peer's, set before e->bfh[] points here */
 	domid_t remote_domid;
 	xf_handle_t *out; 
 	xf_handle_t *in;  
 	int port;       
 	int irq;        
+	struct tasklet_struct rx_tasklet; 
+	spinlock_t out_lock; 
+	skb_queue_t out_queue; 
+	unsigned long tx_dropped; 
+	unsigned long tx_packets, tx_full; /* under out_lock */
+	unsigned long rx_packets, rx_full; /* rx_tasklet only */
+	struct timer_list tx_timer; /* sends a held notification */
+	int tx_held, tx_held_pkts; /* under out_lock: notification held, packets since */
+	cycles_t tx_held_since; 
+	int tx_coalesce; /* under out_lock: adaptive coalescing is on */
+	unsigned long tx_rate_stamp, tx_rate_packets; /* under out_lock: sent since the stamp */
+	struct bf_grant_tx tx_grants[BF_TX_GRANTS]; /* under out_lock */
+	unsigned int tx_grant_prod, tx_grant_cons; 
+	gnttab_copy_t rx_copy[BF_GRANT_COPIES]; /* rx_tasklet only */
 };
 typedef struct bf_handle bf_handle_t;
 
@@ -71,11 +177,19 @@ typedef struct bf_handle bf_handle_t;
 #define BF_EVT_PORT(handle) (handle->port)
 #define BF_EVT_IRQ(handle) (handle->irq)
 
+struct sk_buff;
+
 extern bf_handle_t *bf_create(domid_t, int);
 extern bf_handle_t *bf_connect(domid_t, int, int, int);
 extern void bf_destroy(bf_handle_t *);
+extern int bf_mapped(bf_handle_t *);
 extern void bf_disconnect(bf_handle_t *);
 extern void bf_notify(int port);
+extern int xmit_large_pkt(struct sk_buff *skb, xf_handle_t *xfh);
+extern int bf_xmit(bf_handle_t *bfh, struct sk_buff *skb);
+extern int bf_xmit_pending(bf_handle_t *bfh);
+extern int recv_packets(bf_handle_t *bfh, int budget);
+extern int bf_idle(bf_handle_t *bfh);
 extern irqreturn_t bf_callback(int rq, void *dev_id, struct pt_regs *regs);
 extern void migrate_save(void *);
 extern void migrate_send(void);
@@ -84,9 +198,11 @@ extern void migrate_send(void);
 #define XENLOOP_STATUS_LISTEN 	2
 #define XENLOOP_STATUS_CONNECTED 4
 #define XENLOOP_STATUS_SUSPEND   8
+#define XENLOOP_STATUS_RESIZE   16
 
 typedef struct Entry {
 	struct list_head mapping;
+	struct list_head reap; 	/* unlinked, waiting for a grace period */
 	u8		mac[ETH_ALEN];
 	u8		status;
 	u8		listen_flag; 
@@ -94,7 +210,11 @@ typedef struct Entry {
 	domid_t		domid;	
 	ulong		timestamp;
 	struct timer_list *ack_timer; 
-	bf_handle_t 	*bfh; 
+	bf_handle_t 	*bfh[XENLOOP_MAX_QUEUES]; /* bfh[0] also carries suspension; 
+						     rcu_dereference these */
+	u8		num_queues; /* ring pairs in use for transmit */
+	u8		order; 	/* listener: entry order of the FIFOs, 0 for the default */
+	u8		idle_checks; /* listener: resize checks without traffic */
 } Entry;
 
 
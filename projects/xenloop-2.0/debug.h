@@ -36,7 +36,9 @@
 #define _DEBUG_H_
 
 
+#ifndef XENLOOP_USER
 #include <linux/netdevice.h>
+#endif
 
 //#define DEBUG
 
@@ -63,9 +63,15 @@
 #include <linux/wait.h>
 #include <linux/timer.h>
 #include <linux/spinlock.h>
+#include <linux/jhash.h>
+#include <linux/ip.h>
+#include <linux/irq.h>
+#include <linux/hash.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include "bififo.h"
 #include "main.h"
 #include "debug.h"
-#include "bififo.h"
 #include "maptable.h"
 
 
@@ -77,8 +83,8 @@ extern void     update_table(HashTable *,u8 *, int);
 extern void	mark_suspend(HashTable *);
 extern int	has_suspend_entry(HashTable *);
 extern void	clean_suspended_entries(HashTable * ht);
-extern void 	notify_all_bfs(HashTable * ht);
 extern void	check_timeout(HashTable * ht);
+extern void	check_resize(HashTable * ht);
 
 static domid_t my_domid;
 static u8 my_macs[MAX_MAC_NUM][ETH_ALEN];
@@ -89,18 +95,150 @@ static int if_drops = 0;
 static int if_over = 0;
 static int if_fifo = 0;
 static int if_total = 0;
-static skb_queue_t out_queue;
-static skb_queue_t pending_free;
 
 static int xenloop_connect(message_t *msg, Entry *e); 
 static int xenloop_listen(Entry *e);
 static struct task_struct *suspend_thread = NULL;
 DECLARE_WAIT_QUEUE_HEAD(swq);
-static struct task_struct *pending_thread = NULL;
-DECLARE_WAIT_QUEUE_HEAD(pending_wq);
 
 HashTable mac_domid_map;
 
+/*
+ * Ring pairs per peer. Each has its own event channel bound to its own 
+ * vCPU, and flows to a peer are spread over them by hash, so that 
+ * several flows between two guests do not serialize on one ring and one 
+ * interrupt. The listener proposes its number, the connector takes as 
+ * many of them as it wants itself.
+ */
+static int num_queues = 0;
+module_param(num_queues, int, 0444);
+MODULE_PARM_DESC(num_queues, "Ring pairs per peer (default one per vCPU, at most 8)");
+
+/*
+ * Ring size. Each FIFO starts with 2^entry_order 64 byte slots. A
+ * listener whose rings ran nearly full since the last check doubles 
+ * them, up to 2^max_entry_order; one that has been idle for 
+ * XENLOOP_IDLE_CHECKS checks shrinks them back to 2^min_entry_order. 
+ * Both are clamped to what one FIFO can map. With the defaults all 
+ * three are equal and the rings never change size.
+ */
+static int entry_order = XENLOOP_ENTRY_ORDER;
+module_param(entry_order, int, 0644);
+MODULE_PARM_DESC(entry_order, "Initial log2 of the entries in each FIFO");
+
+static int min_entry_order = XENLOOP_ENTRY_ORDER;
+module_param(min_entry_order, int, 0644);
+MODULE_PARM_DESC(min_entry_order, "Log2 of the entries an idle FIFO shrinks to");
+
+static int max_entry_order = XENLOOP_ENTRY_ORDER;
+module_param(max_entry_order, int, 0644);
+MODULE_PARM_DESC(max_entry_order, "Log2 of the entries a busy FIFO grows to");
+
+#define XENLOOP_IDLE_CHECKS 12 	/* a minute of SUSPEND_TIMEOUT periods */
+
+static int xenloop_clamp_order(int order)
+{
+	if (order < XENLOOP_MIN_ENTRY_ORDER)
+		return XENLOOP_MIN_ENTRY_ORDER;
+	if (order > XENLOOP_MAX_ENTRY_ORDER)
+		return XENLOOP_MAX_ENTRY_ORDER;
+	return order;
+}
+
+/*
+ * Called for each connected listener every SUSPEND_TIMEOUT. Returns the 
+ * order to rebuild its rings with, or 0 to keep them.
+ */
+int resize_order(Entry *e)
+{
+	unsigned long full = 0, busy = 0;
+	int q, lo = xenloop_clamp_order(min_entry_order);
+	int hi = xenloop_clamp_order(max_entry_order);
+	bf_handle_t *bfh;
+	unsigned long flags;
+
+	for (q = 0; q < XENLOOP_MAX_QUEUES; q++) {
+		if (!(bfh = e->bfh[q]))
+			continue;
+		spin_lock_irqsave(&bfh->out_lock, flags);
+		full += bfh->tx_full;
+		busy += bfh->tx_packets;
+		bfh->tx_full = bfh->tx_packets = 0;
+		spin_unlock_irqrestore(&bfh->out_lock, flags);
+		full += bfh->rx_full;
+		busy += bfh->rx_packets;
+		bfh->rx_full = bfh->rx_packets = 0;
+	}
+
+	e->idle_checks = busy ? 0 : e->idle_checks + 1;
+
+	if (hi < lo)
+		hi = lo;
+	if (full && e->order < hi)
+		return e->order + 1;
+	if (e->order > hi)
+		return hi;
+	if (e->order > lo && e->idle_checks >= XENLOOP_IDLE_CHECKS)
+		return lo;
+	if (e->order < lo)
+		return lo;
+	return 0;
+}
+
+static int xenloop_num_queues(void)
+{
+	int n = (num_queues > 0) ? num_queues : num_online_cpus();
+
+	return (n > XENLOOP_MAX_QUEUES) ? XENLOOP_MAX_QUEUES : n;
+}
+
+/*
+ * Deliver the events of queue q, and so run its tasklet, on the q-th 
+ * online vCPU. This does what a write to /proc/irq/N/smp_affinity does, 
+ * so that file shows the binding and can move it later.
+ */
+static void xenloop_bind_queue(bf_handle_t *bfh, int q)
+{
+	unsigned int irq = BF_EVT_IRQ(bfh);
+	struct irq_desc *desc = irq_desc + irq;
+	unsigned long flags;
+	cpumask_t mask;
+	int cpu, n = q % num_online_cpus();
+
+	for_each_online_cpu(cpu)
+		if (n-- == 0)
+			break;
+
+	if (!desc->chip || !desc->chip->set_affinity)
+		return;
+
+	mask = cpumask_of_cpu(cpu);
+	spin_lock_irqsave(&desc->lock, flags);
+	set_native_irq_info(irq, mask);
+	desc->chip->set_affinity(irq, mask);
+	spin_unlock_irqrestore(&desc->lock, flags);
+}
+
+/* Pick the queue for skb, the same one for every packet of a flow */
+static inline int xenloop_queue(Entry *e, struct sk_buff *skb)
+{
+	struct iphdr *iph = skb->nh.iph;
+	u32 _ports, *ports = NULL;
+	int n = e->num_queues;
+
+	/* 0 if the rings are being rebuilt under us */
+	if (n <= 1)
+		return 0;
+
+	if (!(iph->frag_off & htons(IP_MF|IP_OFFSET)) && 
+	    (iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP))
+		ports = skb_header_pointer(skb, skb->nh.raw - skb->data + iph->ihl*4, 
+					   sizeof(_ports), &_ports);
+
+	return jhash_3words(iph->saddr, iph->daddr, ports ? *ports : 0, iph->protocol) 
+		% n;
+}
+
 
 static int  write_xenstore(int status)
 {
@@ -254,6 +392,7 @@ int session_recv(struct sk_buff * skb, net_device * dev, packet_type * pt, net_d
 	
 	skb_linearize(skb);
 	
+	rcu_read_lock();
 	switch(msg->type) {
 		case XENLOOP_MSG_TYPE_SESSION_DISCOVER:
 			if (!freezed)
@@ -268,6 +407,14 @@ int session_recv(struct sk_buff * skb, net_device * dev, packet_type * pt, net_d
 		case XENLOOP_MSG_TYPE_CREATE_ACK:
 			e = pre_check_msg(msg);
 			if(!e)	goto out;
+
+			/* A late ack for rings torn down since */
+			if (e->status != XENLOOP_STATUS_LISTEN)
+				goto out;
+
+			/* Queues the connector did not take stay idle until teardown */
+			if (msg->num_queues > 0 && msg->num_queues < e->num_queues)
+				e->num_queues = msg->num_queues;
 			
 			e->status = XENLOOP_STATUS_CONNECTED;
 			if (e->ack_timer)
@@ -279,6 +426,7 @@ int session_recv(struct sk_buff * skb, net_device * dev, packet_type * pt, net_d
 	}
 	
 out:		
+	rcu_read_unlock();
 	kfree_skb(skb);
 	TRACE_EXIT;
 	return ret; 
@@ -335,10 +483,11 @@ inline void net_send(struct sk_buff * skb, u8 * dest)
 }
 
 
-void send_create_chn_msg(int gref_in, int gref_out, int remote_port, u8 *dest_mac) 
+void send_create_chn_msg(Entry *e) 
 {
 	message_t *m;
 	struct sk_buff *skb;
+	int i;
 
 	TRACE_ENTRY;
 
@@ -352,16 +501,19 @@ void send_create_chn_msg(int gref_in, int gref_out, int remote_port, u8 *dest_ma
 	m->domid= my_domid;
 	m->mac_count = num_of_macs;
 	memcpy(m->mac, my_macs, num_of_macs*ETH_ALEN);
-	m->gref_in = gref_in;
-	m->gref_out = gref_out;
-	m->remote_port = remote_port;
+	m->num_queues = e->num_queues;
+	for (i = 0; i < e->num_queues; i++) {
+		m->gref_in[i] = BF_GREF_IN(e->bfh[i]);
+		m->gref_out[i] = BF_GREF_OUT(e->bfh[i]);
+		m->remote_port[i] = BF_EVT_PORT(e->bfh[i]);
+	}
  
-	net_send(skb, dest_mac);
+	net_send(skb, e->mac);
 
 	TRACE_EXIT;
 }
 
-void send_create_ack_msg(u8 *dest_mac) 
+void send_create_ack_msg(u8 *dest_mac, u8 num_queues) 
 {
 	message_t *m;
 	struct sk_buff *skb;
@@ -377,6 +529,7 @@ void send_create_ack_msg(u8 *dest_mac)
 	m->domid= my_domid;
 	m->mac_count = num_of_macs;
 	memcpy(m->mac, my_macs, num_of_macs*ETH_ALEN);
+	m->num_queues = num_queues;
  
 	net_send(skb, dest_mac);
 
@@ -386,7 +539,6 @@ void send_create_ack_msg(u8 *dest_mac)
 static void ack_timeout(ulong data) 
 {
 	Entry *e = (void *)data;
-	bf_handle_t *bfl;
 
 	TRACE_ENTRY;
 
@@ -399,21 +551,17 @@ static void ack_timeout(ulong data)
 
 	BUG_ON(e->status != XENLOOP_STATUS_LISTEN);
 
- 	bfl = e->bfh;
-	BUG_ON(!bfl);
+ 	BUG_ON(!e->bfh[0]);
 
 	if(e->retry_count < MAX_RETRY_COUNT ) {
 		
-		send_create_chn_msg(BF_GREF_IN(bfl),		\
-					BF_GREF_OUT(bfl),	\
-					BF_EVT_PORT(bfl),	\
-					e->mac);
+		send_create_chn_msg(e);
 		e->retry_count++;
 		mod_timer(e->ack_timer, jiffies + XENLOOP_ACK_TIMEOUT*HZ);
 	} else {
-		if (check_descriptor(e->bfh)) {
-			BF_SUSPEND_IN(e->bfh) = 1;
-			BF_SUSPEND_OUT(e->bfh) = 1;
+		if (check_descriptor(e->bfh[0])) {
+			BF_SUSPEND_IN(e->bfh[0]) = 1;
+			BF_SUSPEND_OUT(e->bfh[0]) = 1;
 		}
 		e->status = XENLOOP_STATUS_SUSPEND;
 		wake_up_interruptible(&swq);
@@ -430,7 +578,7 @@ static int xenloop_listen(Entry *e)
 	unsigned long flag;
 	domid_t remote_domid = e->domid; 
 	bf_handle_t *bfl = NULL;
-	int i;
+	int i, q, n = xenloop_num_queues();
 	bf_data_t *pbf;
 
 	TRACE_ENTRY;
@@ -449,8 +597,30 @@ static int xenloop_listen(Entry *e)
 
 
 	
-	bfl = bf_create(remote_domid, XENLOOP_ENTRY_ORDER); 
-	if(!bfl) {
+	if (!e->order)
+		e->order = xenloop_clamp_order(entry_order);
+
+	/* Settle for fewer queues if memory runs short, but not for none */
+	for (q = 0; q < n; q++) {
+		bfl = bf_create(remote_domid, e->order); 
+		if(!bfl)
+			break;
+
+		for(i=0; i<=xf_size(bfl->in); i++) {
+			pbf = xf_entry(bfl->in, bf_data_t, i);
+			pbf->status = BF_FREE;
+		}
+		for(i=0; i<=xf_size(bfl->out); i++) {
+			pbf = xf_entry(bfl->out, bf_data_t, i);
+			pbf->status = BF_FREE;
+		}
+
+		xenloop_bind_queue(bfl, q);
+		bfl->entry = e;
+		rcu_assign_pointer(e->bfh[q], bfl);
+	}
+
+	if(q == 0) {
 		e->status = XENLOOP_STATUS_INIT; 
 
 		EPRINTK("bf_creat failed\n");
@@ -458,23 +628,11 @@ static int xenloop_listen(Entry *e)
 		return -1;
 	}
 
-	for(i=0; i<=xf_size(bfl->in); i++) {
-		pbf = xf_entry(bfl->in, bf_data_t, i);
-		pbf->status = BF_FREE;
-	}
-	for(i=0; i<=xf_size(bfl->out); i++) {
-		pbf = xf_entry(bfl->out, bf_data_t, i);
-		pbf->status = BF_FREE;
-	}
-
 	e->listen_flag = 1;
-	e->bfh = bfl;
+	e->num_queues = q;
 
 	
-	send_create_chn_msg(BF_GREF_IN(bfl),
-				BF_GREF_OUT(bfl),
-				BF_EVT_PORT(bfl),
-				e->mac);
+	send_create_chn_msg(e);
 
 	
 	e->ack_timer = kmalloc(sizeof(struct timer_list), GFP_ATOMIC);
@@ -493,39 +651,62 @@ static int xenloop_connect(message_t *msg, Entry *e)
 {
 	domid_t remote_domid = e->domid; 
 	bf_handle_t *bfc = NULL;
+	int q, n = xenloop_num_queues();
 
 	TRACE_ENTRY;
 
 	BUG_ON(!msg);
 
 	if(e->status == XENLOOP_STATUS_CONNECTED) {
-		send_create_ack_msg(e->mac);
+		send_create_ack_msg(e->mac, e->num_queues);
 		TRACE_EXIT;
 		return 0;
 	}
 
-	
-	if(msg->gref_in <= 0 || msg->gref_out <= 0 || msg->remote_port <= 0) {
-		EPRINTK("gref_in %d gref_out %d remote_port %d\n", msg->gref_in, msg->gref_out, msg->remote_port);
-		goto err;
+	/* The old rings are still being torn down: the listener retries */
+	if(e->status != XENLOOP_STATUS_INIT) {
+		DB("CREATE_CHN ignored in status %d\n", e->status);
+		TRACE_EXIT;
+		return 0;
 	}
 
-	
-	bfc = bf_connect(remote_domid, msg->gref_out, msg->gref_in,\
-				 msg->remote_port);
-	if(!bfc) {
-		EPRINTK("bf_connect failed\n");
+	if(msg->num_queues == 0 || msg->num_queues > XENLOOP_MAX_QUEUES) {
+		EPRINTK("num_queues %d\n", msg->num_queues);
 		goto err;
 	}
+	if(msg->num_queues < n)
+		n = msg->num_queues;
+
+	for (q = 0; q < n; q++) {
+		if(msg->gref_in[q] <= 0 || msg->gref_out[q] <= 0 || msg->remote_port[q] <= 0) {
+			EPRINTK("queue %d gref_in %d gref_out %d remote_port %d\n", q, 
+				msg->gref_in[q], msg->gref_out[q], msg->remote_port[q]);
+			break;
+		}
+
+		bfc = bf_connect(remote_domid, msg->gref_out[q], msg->gref_in[q],\
+					 msg->remote_port[q]);
+		if(!bfc) {
+			EPRINTK("bf_connect failed\n");
+			break;
+		}
+
+		xenloop_bind_queue(bfc, q);
+		bfc->entry = e;
+		rcu_assign_pointer(e->bfh[q], bfc);
+	}
+
+	if(q == 0)
+		goto err;
 
 	e->listen_flag = 0;
-	e->bfh = bfc;
+	e->num_queues = q;
 
 	e->status = XENLOOP_STATUS_CONNECTED;
 	DPRINTK("CONNECTOR status changed to XENLOOP_STATUS_CONNECTED!!!\n");
 
 	
-	send_create_ack_msg(e->mac);
+	send_create_ack_msg(e->mac, e->num_queues);
 
 	TRACE_EXIT;
 	return 0;
@@ -536,142 +717,67 @@ err:
 
 
 
-static int xmit_large_pkt(struct sk_buff *skb, xf_handle_t *xfh)
-{
-	bf_data_t *mdata;
-	char *pback, *pfront, *pfifo;
-	int num_entries, ret, len=0, len1=0, len2=0;
-
-	TRACE_ENTRY;
-	BUG_ON(!skb);
-	BUG_ON(!xfh);
-
-	if( skb->len + sizeof(bf_data_t) > xf_free(xfh)*sizeof(bf_data_t) ) {
-		TRACE_EXIT;
-		return -1;
-	}
-
-	mdata  = xf_entry(xfh, bf_data_t, xf_size(xfh));
-	BUG_ON(!mdata);
-
-	mdata->status = BF_WAITING;
-	mdata->type = BF_PACKET;
-	mdata->pkt_info = skb->len; 
-
-	num_entries = skb->len/sizeof(bf_data_t);
-	if (skb->len % sizeof(bf_data_t)) 
-		num_entries++;
-
-	pfifo = (char *)xfh->fifo;
-	pfront = (char *)xf_entry(xfh, bf_data_t, 0);
-	pback = (char *) xf_entry(xfh, bf_data_t, xf_size(xfh) + 1);
-
-	BUG_ON(!pfifo);
-	BUG_ON(!pfront);
-	BUG_ON(!pback);
-
-	if( pback >= pfront ) {
-		len1 = (pfifo + xfh->descriptor->max_data_entries*sizeof(bf_data_t)) - pback;
-		len = (len1 >= skb->len) ? skb->len : len1;
-		if(skb_copy_bits(skb, 0, pback, len))
-			BUG();
-
-		len2 = skb->len - len;
-		if( len2  > 0 ) {
-			if(skb_copy_bits(skb, len, pfifo, len2))
-				BUG();
-		}
-	} else {
-		if(skb_copy_bits(skb, 0, pback, skb->len))
-			BUG();
-	}
-
-	ret = xf_pushn(xfh, num_entries + 1);
-	BUG_ON( ret < 0 );
+/*
+ * Per-CPU cache of what lookup_table last found for a neighbour, misses 
+ * included, so that most packets skip the hash and the bucket walk. Any 
+ * insert or remove moves mac_domid_map.generation, which invalidates 
+ * every slot, so a cached Entry is never one that has been freed. The 
+ * address is compared as well, as a neighbour may be freed and another 
+ * one allocated in its place. iphook_out also runs in process context, 
+ * so bottom halves are kept off while a slot is read or rewritten.
+ */
+#define NEIGH_CACHE_BITS 4
 
-	TRACE_EXIT;
+struct neigh_cache {
+	struct neighbour *neigh;
+	ulong		generation;
+	u8		mac[ETH_ALEN];
+	Entry		*e;
+};
 
-	return 0;
-}
+static DEFINE_PER_CPU(struct neigh_cache, neigh_cache[1 << NEIGH_CACHE_BITS]);
 
-void enqueue(skb_queue_t *Q, struct sk_buff *skb)
+static inline Entry *lookup_neigh(struct neighbour *neigh)
 {
-	if (Q->count++ == 0) {
-		Q->head = skb;
-		Q->tail = skb;
-	} else {
-		Q->tail->next = skb;
-		Q->tail = skb;
-	}
-}
+	struct neigh_cache *c;
+	ulong generation = mac_domid_map.generation;
+	Entry *e;
 
-void dequeue(skb_queue_t *Q)
-{
-	if (Q->head != Q->tail)
-		Q->head = Q->head->next;
-	if (--Q->count == 0) {
-		Q->head = NULL;
-		Q->tail = NULL;
+	/* a lookup under this generation sees the change that moved it */
+	smp_rmb();
+	local_bh_disable();
+	c = &per_cpu(neigh_cache, smp_processor_id())[hash_ptr(neigh, NEIGH_CACHE_BITS)];
+	if (c->neigh == neigh && c->generation == generation && equal(c->mac, neigh->ha)) {
+		e = c->e;
+	} else {
+		e = lookup_table(&mac_domid_map, neigh->ha);
+		c->neigh = neigh;
+		c->generation = generation;
+		memcpy(c->mac, neigh->ha, ETH_ALEN);
+		c->e = e;
 	}
-}
+	local_bh_enable();
 
-void clean_pending(skb_queue_t *Q) {
-	struct sk_buff *skb;
-	while (Q->count > 0) {
-		skb = Q->head;
-		dequeue(Q);
-		kfree_skb(skb);
-	}
+	return e;
 }
 
-
-inline int xmit_packets(struct sk_buff *skb)
+/*
+ * Hand skb to the peer behind e. Whatever does not fit into the FIFO right 
+ * away is retried when the peer signals that it has made room. 
+ * Call under rcu_read_lock.
+ */
+inline int xmit_packets(Entry *e, struct sk_buff *skb)
 {
-	static DEFINE_SPINLOCK(xmit_lock);
+	bf_handle_t *bfh;
 	int ret = 0;
-	unsigned long flags;
 
 	TRACE_ENTRY;
 
 	BUG_ON( in_irq() );
 
-	spin_lock_irqsave( &xmit_lock, flags );
-
-	if(skb) {
-		if ( skb->len + sizeof(bf_data_t) < (1 << XENLOOP_ENTRY_ORDER)*sizeof(bf_data_t) ) 
-			enqueue(&out_queue, skb);
-		else {
-			DB("Packet size greater than total fifo size\n");
-			ret = -1;
-		}
-	}
-
-	while (out_queue.count > 0) {
-		int rc;
-		Entry *e;
-
-		skb = out_queue.head;
-		BUG_ON(!skb);
-
-		e = lookup_table(&mac_domid_map, skb->dst->neighbour->ha);
-		BUG_ON(!e);
-
-		rc = xmit_large_pkt(skb, e->bfh->out);
-
-		if (rc < 0) {
-			bf_notify(e->bfh->port);
-			wake_up_interruptible(&pending_wq);
-			break;
-		}
-
-		dequeue(&out_queue);
-
-		kfree_skb(skb);
-	}
-
-	spin_unlock_irqrestore( &xmit_lock, flags );
-
-	notify_all_bfs(&mac_domid_map);
+	bfh = rcu_dereference(e->bfh[xenloop_queue(e, skb)]);
+	if (!bfh || bf_xmit(bfh, skb) < 0)
+		ret = -1;
 
 	TRACE_EXIT;
 	return ret;
@@ -687,6 +793,7 @@ static unsigned int iphook_out(
 	int (*okfn)(struct sk_buff *))
 {
 	Entry * e;
+	bf_handle_t *bfh;
 	int ret = NF_ACCEPT;
 	struct sk_buff *skb= *pskb;
         struct dst_entry *dst = skb->dst;
@@ -705,16 +812,19 @@ static unsigned int iphook_out(
 		return NF_ACCEPT;
 	}
 	
-	if (!(e = lookup_table(&mac_domid_map, neigh->ha))) {
+	rcu_read_lock();
+	if (!(e = lookup_neigh(neigh))) {
+		rcu_read_unlock();
 		return NF_ACCEPT;
 	}
 
 	TRACE_ENTRY;
 		
-	if (check_descriptor(e->bfh) && (BF_SUSPEND_IN(e->bfh) || BF_SUSPEND_OUT(e->bfh))) {
+	bfh = rcu_dereference(e->bfh[0]);
+	if (check_descriptor(bfh) && (BF_SUSPEND_IN(bfh) || BF_SUSPEND_OUT(bfh))) {
 		e->status = XENLOOP_STATUS_SUSPEND;
 		wake_up_interruptible(&swq);
-		return NF_ACCEPT;
+		goto out;
 	}
 
 	switch (e->status) {
@@ -722,12 +832,10 @@ static unsigned int iphook_out(
 			if( my_domid < e->domid)  {
 				xenloop_listen(e);
 			}
-
-			TRACE_EXIT;
-			return NF_ACCEPT;
+			break;
 
 		case XENLOOP_STATUS_CONNECTED:
-			if( xmit_packets(skb) < 0  ) {
+			if( xmit_packets(e, skb) < 0  ) {
 				EPRINTK("Couldn't send packet via bififo. Using network instead\n");
 				ret = NF_ACCEPT;
 				goto out;
@@ -738,10 +846,10 @@ static unsigned int iphook_out(
 
 		case XENLOOP_STATUS_LISTEN:
 		default:
-			TRACE_EXIT;
-			return ret;
+			break;
 	}
 out:
+	rcu_read_unlock();
 	TRACE_EXIT;
 	return ret;
 }
@@ -761,12 +869,15 @@ static unsigned int iphook_in(
 	struct sk_buff *skb= *pskb;
 	u8 *src_mac = eth_hdr(skb)->h_source;
 
+	rcu_read_lock();
 	if (!(e = lookup_table(&mac_domid_map, src_mac))) {
+		rcu_read_unlock();
 		return ret;
 	}
 
 	if ((e->status == XENLOOP_STATUS_INIT) && (my_domid < e->domid))
 		xenloop_listen(e);
+	rcu_read_unlock();
 
 	TRACE_EXIT;
 
@@ -870,23 +981,6 @@ void post_migration(void)
 }
 
 
-#define LONG_PENDING_TIMEOUT 1 // seconds
-#define SHORT_PENDING_TIMEOUT 1 // jiffies
-static int xmit_pending(void *useless)
-{
-	unsigned long timeout;
-	TRACE_ENTRY;
-	
-	while(!kthread_should_stop()) {
-		timeout = out_queue.count ? SHORT_PENDING_TIMEOUT : LONG_PENDING_TIMEOUT*HZ;
-		wait_event_interruptible_timeout(pending_wq, (out_queue.count > 0), timeout);
-		//if (out_queue.count > 0)
-		xmit_packets(NULL);
-	}
-	TRACE_EXIT;
-	return 0;
-}
-
 #define SUSPEND_TIMEOUT 5
 static int check_suspend(void *useless)
 {
@@ -899,6 +993,7 @@ static int check_suspend(void *useless)
 			clean_suspended_entries(&mac_domid_map);
 		} else if (ret == 0) {
 			check_timeout(&mac_domid_map);
+			check_resize(&mac_domid_map);
 		}
 	}
 	TRACE_EXIT;
@@ -974,9 +1069,6 @@ static void __exit xenloop_exit(void)
 	write_xenstore(0);
 	freezed = 1;
 
-	if(pending_thread)
-		kthread_stop(pending_thread);
-
 	mark_suspend(&mac_domid_map);
 
 	if(suspend_thread)
@@ -987,6 +1079,7 @@ static void __exit xenloop_exit(void)
 	net_exit();
 
 	clean_table(&mac_domid_map);
+	xf_pool_drain();
 
 	DPRINTK("Exiting xenloop module.\n");
 	TRACE_EXIT;
@@ -999,15 +1092,6 @@ static int __init xenloop_init(void)
 
 	TRACE_ENTRY;
 
-	out_queue.head = NULL;
-	out_queue.tail = NULL;
-	out_queue.count = 0;
-
-	pending_free.head = NULL;
-	pending_free.tail = NULL;
-	pending_free.count = 0;
-	
-	
 	if(init_hash_table(&mac_domid_map, "MAC_DOMID_MAP_Table") != 0) {
 		rc = -ENOMEM;
 		goto out;
@@ -1029,13 +1113,6 @@ static int __init xenloop_init(void)
                 EPRINTK("Failed to set shutdown watcher\n");
         }
 
-	pending_thread = kthread_run(xmit_pending, NULL, "pending");
-	if(!pending_thread) {
-		xenloop_exit();
-		rc = -1;
-		goto out;
-	}
-
 	suspend_thread = kthread_run(check_suspend, NULL, "suspend");
 	if(!suspend_thread) {
 		xenloop_exit();
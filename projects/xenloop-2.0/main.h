@@ -53,8 +53,6 @@ typedef struct packet_type 	packet_type;
 #define XENLOOP_MSG_TYPE_CREATE_ACK 		4
 #define XENLOOP_MSG_TYPE_DESTROY_CHN 		8
 
-#define XENLOOP_ENTRY_ORDER 15
-
 
 typedef struct message {
 	u8		type;
@@ -63,19 +61,13 @@ typedef struct message {
 	domid_t 	domid;
 	domid_t	        guest_domids[MAX_MAC_NUM];
 	
-	int		gref_in;
-	int		gref_out;
-	int		remote_port;
+	u8		num_queues;
+	int		gref_in[XENLOOP_MAX_QUEUES];
+	int		gref_out[XENLOOP_MAX_QUEUES];
+	int		remote_port[XENLOOP_MAX_QUEUES];
 
 } message_t;
 
-typedef struct skb_queue{
-        struct sk_buff *head;
-        struct sk_buff *tail;
-        int count;
-} skb_queue_t;
-
-
 #define LINK_HDR 			sizeof(struct ethhdr)
 #define MSGSIZE				sizeof(message_t)
 const int 		headers = LINK_HDR + MSGSIZE;
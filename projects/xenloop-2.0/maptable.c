@@ -32,13 +32,25 @@
  */
 
 
+#include <linux/delay.h>
+#include <linux/rcupdate.h>
+
 #include "maptable.h"
 #include "debug.h"
 #include "bififo.h"
 
 extern void send_destroy_chn_msg(u8 *dest_mac); 
+extern int resize_order(Entry *e);
 extern wait_queue_head_t swq;
 
+/*
+ * glock serializes changes to the buckets. Lookups take no lock but 
+ * rcu_read_lock, and must not sleep while they hold an Entry. Only the 
+ * suspend thread removes entries, and module exit once it has stopped, 
+ * so that thread walks the table without rcu_read_lock and may sleep. 
+ * Removal unlinks an entry, waits for a grace period and only then 
+ * tears its channels down and frees it; see reap_entries.
+ */
 static DEFINE_SPINLOCK(glock);
 
 ulong  hash(u8 *pmac){
@@ -69,62 +81,76 @@ inline void insert_table(HashTable * ht, void * key, u8 domid)
 	e->ack_timer = NULL;
 	e->status = XENLOOP_STATUS_INIT;
 	e->listen_flag = 0xff;
-	e->bfh = NULL;
+	memset(e->bfh, 0, sizeof(e->bfh));
+	e->num_queues = 0;
+	e->order = 0;
+	e->idle_checks = 0;
 	e->retry_count = 0;
 	
 	spin_lock_irqsave(&glock, flags);
-	list_add(&e->mapping, &(b->bucket));
+	list_add_rcu(&e->mapping, &(b->bucket));
 	ht->count++;
+	smp_wmb();	/* pairs with the smp_rmb in lookup_neigh */
+	ht->generation++;
 	spin_unlock_irqrestore(&glock, flags);
 }
 
 
 
-inline void remove_entry(HashTable *ht, Entry *e, struct list_head *x) {
+static void unlink_entry(HashTable *ht, Entry *e, struct list_head *dead)
+{
 	ulong flags;
 
-	TRACE_ENTRY;
 	spin_lock_irqsave(&glock, flags);
-	list_del(x);
+	list_del_rcu(&e->mapping);
 	ht->count--;
+	smp_wmb();	/* pairs with the smp_rmb in lookup_neigh */
+	ht->generation++;
 	spin_unlock_irqrestore(&glock, flags);
 
-	if (e->bfh) {
+	list_add(&e->reap, dead);
+}
+
+static void free_entry(HashTable *ht, Entry *e)
+{
+	int i;
+
+	TRACE_ENTRY;
+
+	for (i = 0; i < XENLOOP_MAX_QUEUES; i++) {
+		if (!e->bfh[i])
+			continue;
 		if(e->listen_flag) {
-			bf_destroy(e->bfh);
+			bf_destroy(e->bfh[i]);
 		} else {
-			bf_disconnect(e->bfh);
+			bf_disconnect(e->bfh[i]);
 		}
-		e->bfh = NULL;
+		e->bfh[i] = NULL;
 	}
 	e->status  = XENLOOP_STATUS_INIT;
 
 	if (e->ack_timer)
 		del_timer_sync(e->ack_timer);
 	
-	kmem_cache_free(ht->entries, e);
 	DPRINTK("Delete Guest: deleted one guest mac =" MAC_FMT " Domid = %d.\n", \
 		 MAC_NTOA(e->mac), e->domid);
+	kmem_cache_free(ht->entries, e);
 	TRACE_EXIT;
 }
 
-inline Entry* lookup_bfh(HashTable * ht, void * key)
+/* Free the entries unlinked onto dead once no lookup can still see them */
+static void reap_entries(HashTable *ht, struct list_head *dead)
 {
-	int i;
-	struct list_head * x, * y;
-	Entry * e;
+	struct list_head *x, *y;
 
-	for(i = 0; i < HASH_SIZE; i++) { 
-		list_for_each_safe(x, y, &(ht->table[i].bucket)) {
-			e = list_entry(x, Entry, mapping);
-			if(key ==  e->bfh) {
-				return e;
-			}
-		}
-	}
-	return NULL;
-}
+	if (list_empty(dead))
+		return;
 
+	synchronize_rcu();
+
+	list_for_each_safe(x, y, dead)
+		free_entry(ht, list_entry(x, Entry, reap));
+}
 
 
 inline void * lookup_table(HashTable * ht, void * key) 
@@ -135,7 +161,7 @@ inline void * lookup_table(HashTable * ht, void * key)
 	if(!list_empty(&b->bucket)) {
 		struct list_head * x;
 		Entry * e;
-		list_for_each(x, &(b->bucket)) {
+		list_for_each_rcu(x, &(b->bucket)) {
 			e = list_entry(x, Entry, mapping);
 			if(equal(key, (u8 *) e->mac)) {
 				d = e;
@@ -168,41 +194,24 @@ inline void mark_suspend(HashTable * ht)
 {
 	int i;
 	Entry *e;
-	struct list_head *x, *y;
+	bf_handle_t *bfh;
+	struct list_head *x;
 	Bucket * table = ht->table;
 	TRACE_ENTRY;
+	rcu_read_lock();
 	for(i = 0; i < HASH_SIZE; i++) {
-		list_for_each_safe(x, y, &(table[i].bucket)) {
+		list_for_each_rcu(x, &(table[i].bucket)) {
 			e = list_entry(x, Entry, mapping);
-			if (check_descriptor(e->bfh)) {
-				BF_SUSPEND_IN(e->bfh) = 1;
-				BF_SUSPEND_OUT(e->bfh) = 1;
-				bf_notify(e->bfh->port);
+			bfh = rcu_dereference(e->bfh[0]);
+			if (check_descriptor(bfh)) {
+				BF_SUSPEND_IN(bfh) = 1;
+				BF_SUSPEND_OUT(bfh) = 1;
+				bf_notify(bfh->port);
 			}
 			e->status = XENLOOP_STATUS_SUSPEND;
 		}
 	}
-	TRACE_EXIT;
-}
-
-
-void notify_all_bfs(HashTable * ht) 
-{
-	int i;
-	Entry *e;
-	struct list_head *x, *y;
-	Bucket * table = ht->table;
-
-	TRACE_ENTRY;
-
-	for(i = 0; i < HASH_SIZE; i++) {
-		list_for_each_safe(x, y, &(table[i].bucket)) {
-			e = list_entry(x, Entry, mapping);
-			if ( check_descriptor(e->bfh) && (xf_size( e->bfh->out ) > 0) )
-					bf_notify(e->bfh->port);
-		}
-	}
-
+	rcu_read_unlock();
 	TRACE_EXIT;
 }
 
@@ -218,9 +227,9 @@ inline void check_timeout(HashTable * ht)
 		list_for_each_safe(x, y, &(table[i].bucket)) {
 			e = list_entry(x, Entry, mapping);
 	 		if ((jiffies - e->timestamp) > (5*DISCOVER_TIMEOUT*HZ)) {
-				if (check_descriptor(e->bfh)) {
-					BF_SUSPEND_IN(e->bfh) = 1;
-					BF_SUSPEND_OUT(e->bfh) = 1;
+				if (check_descriptor(e->bfh[0])) {
+					BF_SUSPEND_IN(e->bfh[0]) = 1;
+					BF_SUSPEND_OUT(e->bfh[0]) = 1;
 				}
 				e->status = XENLOOP_STATUS_SUSPEND;
 				found = 1;
@@ -236,13 +245,14 @@ inline void update_table(HashTable * ht, u8 *mac, int mac_count)
 {
 	int i,j,found = 0;
 	Entry *e;
+	bf_handle_t *bfh;
 	void *p;
-	struct list_head *x, *y;
+	struct list_head *x;
 	Bucket * table = ht->table;
 
-	
+	rcu_read_lock();
 	for(j = 0; j < HASH_SIZE; j++) { 
-		list_for_each_safe(x, y, &(table[j].bucket)) {
+		list_for_each_rcu(x, &(table[j].bucket)) {
 			e = list_entry(x, Entry, mapping);
 			for(i = 0, p = mac;  i < mac_count; i++, p+= ETH_ALEN) {
 				if (equal(p, e->mac)) {
@@ -257,15 +267,110 @@ inline void update_table(HashTable * ht, u8 *mac, int mac_count)
 				found = 0;
 				continue;
 			}
-			if (check_descriptor(e->bfh)) {
-				BF_SUSPEND_IN(e->bfh) = 1;
-				BF_SUSPEND_OUT(e->bfh) = 1;
+			bfh = rcu_dereference(e->bfh[0]);
+			if (check_descriptor(bfh)) {
+				BF_SUSPEND_IN(bfh) = 1;
+				BF_SUSPEND_OUT(bfh) = 1;
 			}
 			e->status = XENLOOP_STATUS_SUSPEND;
 			found = 0;
 			wake_up_interruptible(&swq);
 		}
 	}
+	rcu_read_unlock();
+}
+
+
+/*
+ * Rebuild the rings of a listener with 2^order entries. Traffic takes 
+ * the network while the rings drain, the connector is told to tear its 
+ * side down exactly as for a suspend, the old pages are freed once it 
+ * has unmapped them, and the next packet to the peer listens again with 
+ * the new order.
+ */
+static void resize_entry(Entry *e, int order)
+{
+	bf_handle_t *bfh[XENLOOP_MAX_QUEUES];
+	int i, q;
+
+	TRACE_ENTRY;
+
+	if (e->ack_timer) {
+		del_timer_sync(e->ack_timer);
+		kfree(e->ack_timer);
+		e->ack_timer = NULL;
+	}
+	e->status = XENLOOP_STATUS_RESIZE;
+
+	for (i = 0; i < 100; i++) {
+		for (q = 0; q < XENLOOP_MAX_QUEUES; q++)
+			if (e->bfh[q] && !bf_idle(e->bfh[q]))
+				break;
+		if (q == XENLOOP_MAX_QUEUES)
+			break;
+		msleep(10);
+	}
+
+	if (check_descriptor(e->bfh[0])) {
+		BF_SUSPEND_IN(e->bfh[0]) = 1;
+		BF_SUSPEND_OUT(e->bfh[0]) = 1;
+		bf_notify(e->bfh[0]->port);
+	}
+
+	for (q = 0; q < XENLOOP_MAX_QUEUES; q++) {
+		bfh[q] = e->bfh[q];
+		rcu_assign_pointer(e->bfh[q], NULL);
+	}
+
+	/* Lookups may still be sending on the old rings */
+	synchronize_rcu();
+
+	/*
+	 * The connector unmaps the rings once it has seen the suspend. 
+	 * Should it never do so, bf_destroy leaks the pages it still maps.
+	 */
+	for (i = 0; i < 500; i++) {
+		for (q = 0; q < XENLOOP_MAX_QUEUES; q++)
+			if (bfh[q] && bf_mapped(bfh[q]))
+				break;
+		if (q == XENLOOP_MAX_QUEUES)
+			break;
+		msleep(10);
+	}
+
+	for (q = 0; q < XENLOOP_MAX_QUEUES; q++)
+		if (bfh[q])
+			bf_destroy(bfh[q]);
+
+	DPRINTK("Resize: guest mac =" MAC_FMT " order %d -> %d\n", 
+		MAC_NTOA(e->mac), e->order, order);
+
+	e->num_queues = 0;
+	e->order = order;
+	e->idle_checks = 0;
+	e->retry_count = 0;
+	e->status = XENLOOP_STATUS_INIT;
+
+	TRACE_EXIT;
+}
+
+
+inline void check_resize(HashTable * ht)
+{
+	int i, order;
+	Entry *e;
+	struct list_head *x, *y;
+	Bucket * table = ht->table;
+
+	for(i = 0; i < HASH_SIZE; i++) { 
+		list_for_each_safe(x, y, &(table[i].bucket)) {
+			e = list_entry(x, Entry, mapping);
+			if (e->status != XENLOOP_STATUS_CONNECTED || !e->listen_flag)
+				continue;
+			if ((order = resize_order(e)))
+				resize_entry(e, order);
+		}
+	}
 }
 
 
@@ -274,6 +379,7 @@ int init_hash_table(HashTable * ht, char * name)
 	int i;
 
 	ht->count 	= 0;
+	ht->generation	= 0;
 	ht->entries = kmem_cache_create(name, sizeof(Entry), 0, 0, NULL, NULL);
 
 	if(!ht->entries) {
@@ -295,15 +401,18 @@ void clean_suspended_entries(HashTable * ht)
 	Entry *e;
 	struct list_head *x, *y;
 	Bucket * table = ht->table;
+	LIST_HEAD(dead);
 
 	for(i = 0; i < HASH_SIZE; i++) { 
 		list_for_each_safe(x, y, &(table[i].bucket)) {
 			e = list_entry(x, Entry, mapping);
 			if (e->status == XENLOOP_STATUS_SUSPEND) {
-				remove_entry(ht, e, x);
+				unlink_entry(ht, e, &dead);
 			} 
 		}
 	}
+
+	reap_entries(ht, &dead);
 }
 
 
@@ -313,13 +422,16 @@ void clean_table(HashTable * ht)
 	Entry *e;
 	struct list_head *x, *y;
 	Bucket * table = ht->table;
+	LIST_HEAD(dead);
 
 	for(i = 0; i < HASH_SIZE; i++) { 
 		list_for_each_safe(x, y, &(table[i].bucket)) {
 			e = list_entry(x, Entry, mapping);
-			remove_entry(ht, e, x);
+			unlink_entry(ht, e, &dead);
 		}
 	}
 
+	reap_entries(ht, &dead);
+
 	BUG_ON(kmem_cache_destroy(ht->entries));
 }
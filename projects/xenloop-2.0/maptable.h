@@ -35,12 +35,14 @@
 #ifndef _MAPTABLE_H
 #define _MAPTABLE_H
 
+#ifndef XENLOOP_USER
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/timer.h>
 #include <linux/kernel.h>
 #include <linux/if_ether.h>
+#endif
 
 #include "xenfifo.h"
 
@@ -62,6 +64,7 @@ typedef struct Bucket {
 typedef struct HashTable {
 	ulong 		count,
 			buckets; 
+	ulong		generation; /* moves on every insert and remove */
 	Bucket  	table[HASH_SIZE];
 	kmem_cache_t	*entries;
 } HashTable;
@@ -0,0 +1,263 @@
+/*
+ *  XenLoop -- A High Performance Inter-VM Network Loopback
+ *
+ *  Two-process FIFO stress test with payload checksums
+ *
+ *  Authors:
+ *  	Jian Wang - Binghamton University (jianwang@cs.binghamton.edu)
+ *  	Kartik Gopalan - Binghamton University (kartik@cs.binghamton.edu)
+ *
+ *  Copyright (C) 2007-2009 Kartik Gopalan, Jian Wang
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Producer and consumer busy-poll the same FIFO from two processes with
+ * no event channel in between, so every push races every pop. Small
+ * rings keep the FIFO wrapping and running full. Each packet carries its
+ * sequence number and a checksum of its payload; the consumer checks
+ * both, so a consumer that reads an entry before the producer's writes
+ * to it are visible, or a producer that overwrites an entry the consumer
+ * is still copying, shows up as a failure. The largest ring is big 
+ * enough that its pages are granted through indirect pages.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include "../debug.h"
+#include "../xenfifo.h"
+#include "../bififo.h"
+
+#define LISTENER_DOMID 	1
+#define CONNECTOR_DOMID 2
+#define MAX_PKT_LEN 	9000
+
+struct chn_msg {
+	int gref_in;
+	int gref_out;
+	int remote_port;
+};
+
+static unsigned int orders[] = { 2, 3, 5, 7, 10, 15 };
+static unsigned long num_pkts = 100000;
+static unsigned int order;
+static int single_cpu;
+
+static unsigned long rx_seq;
+static unsigned long rx_errors;
+
+static inline void relax(void)
+{
+	if (single_cpu)
+		sched_yield();
+	else
+		cpu_relax();
+}
+
+static uint32_t csum(const uint8_t *p, unsigned int len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+/* Lengths from 8 bytes up to what the ring can hold, biased towards small */
+static unsigned int pkt_len(unsigned long seq)
+{
+	unsigned int max = (sizeof(bf_data_t) << order) - sizeof(bf_data_t);
+	unsigned long r = seq * 2654435761UL;
+
+	if (max > MAX_PKT_LEN)
+		max = MAX_PKT_LEN;
+	if (r & 4)
+		max = max < 200 ? max : 200;
+	return 8 + (r >> 3) % (max - 7);
+}
+
+static void fill(uint8_t *p, unsigned int len, unsigned long seq)
+{
+	uint32_t s = (uint32_t)seq, c;
+	unsigned int i;
+
+	memcpy(p, &s, sizeof(s));
+	for (i = sizeof(s); i < len - sizeof(c); i++)
+		p[i] = (uint8_t)(seq + i*7);
+	c = csum(p, len - sizeof(c));
+	memcpy(p + len - sizeof(c), &c, sizeof(c));
+}
+
+static int verify(const uint8_t *p, unsigned int len)
+{
+	uint32_t s, c;
+
+	if (len != pkt_len(rx_seq))
+		return 0;
+	memcpy(&s, p, sizeof(s));
+	memcpy(&c, p + len - sizeof(c), sizeof(c));
+	return s == (uint32_t)rx_seq && c == csum(p, len - sizeof(c));
+}
+
+static void rx_hook(struct sk_buff *skb)
+{
+	static uint8_t buf[MAX_PKT_LEN];
+
+	if (skb->len > sizeof(buf) || skb_copy_bits(skb, 0, buf, skb->len) ||
+	    !verify(buf, skb->len)) {
+		if (rx_errors++ < 5)
+			EPRINTK("order %u: packet %lu (len %u) corrupted\n", order, rx_seq, skb->len);
+	}
+	rx_seq++;
+	kfree_skb(skb);
+}
+
+static int run_listener(int wfd)
+{
+	struct chn_msg msg;
+	bf_handle_t *bfl;
+	bf_data_t *d;
+	unsigned long i;
+
+	xu_set_domid(LISTENER_DOMID);
+	xu_rx_hook = rx_hook;
+
+	bfl = bf_create(CONNECTOR_DOMID, order);
+	if (!bfl)
+		return 1;
+
+	msg.gref_in = BF_GREF_IN(bfl);
+	msg.gref_out = BF_GREF_OUT(bfl);
+	msg.remote_port = BF_EVT_PORT(bfl);
+	if (write(wfd, &msg, sizeof(msg)) != sizeof(msg))
+		return 1;
+
+	/* Single entries through xf_front/xf_pop */
+	for (i = 0; i < num_pkts; i++) {
+		while (!(d = xf_front(bfl->in, bf_data_t)))
+			relax();
+		if (d->pkt_info != (uint32_t)i || d->status != (uint16_t)~i) {
+			if (rx_errors++ < 5)
+				EPRINTK("order %u: entry %lu read %u\n", order, i, d->pkt_info);
+		}
+		xf_pop(bfl->in);
+	}
+
+	/* Packets through recv_packets/copy_large_pkt */
+	while (rx_seq < num_pkts) {
+		if (xf_empty(bfl->in)) {
+			relax();
+			continue;
+		}
+		recv_packets(bfl, 64);
+	}
+
+	bf_destroy(bfl);
+	return rx_errors ? 1 : 0;
+}
+
+static int run_connector(int rfd)
+{
+	struct chn_msg msg;
+	struct sk_buff *skb;
+	bf_handle_t *bfc;
+	bf_data_t *d;
+	unsigned long i;
+
+	xu_set_domid(CONNECTOR_DOMID);
+
+	if (read(rfd, &msg, sizeof(msg)) != sizeof(msg))
+		return 1;
+
+	bfc = bf_connect(LISTENER_DOMID, msg.gref_out, msg.gref_in, msg.remote_port);
+	if (!bfc)
+		return 1;
+
+	for (i = 0; i < num_pkts; i++) {
+		while (!(d = xf_back(bfc->out, bf_data_t)))
+			relax();
+		d->pkt_info = (uint32_t)i;
+		d->status = (uint16_t)~i;
+		xf_push(bfc->out);
+	}
+
+	skb = alloc_skb(MAX_PKT_LEN, GFP_KERNEL);
+	BUG_ON(!skb);
+
+	for (i = 0; i < num_pkts; i++) {
+		skb->len = pkt_len(i);
+		fill(skb->data, skb->len, i);
+		while (xmit_large_pkt(skb, bfc->out) < 0)
+			relax();
+	}
+
+	kfree_skb(skb);
+	bf_disconnect(bfc);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int fds[2], status, i, ret = 0;
+	pid_t rx, tx;
+
+	if (argc > 1)
+		num_pkts = strtoul(argv[1], NULL, 0);
+
+	single_cpu = (sysconf(_SC_NPROCESSORS_ONLN) == 1);
+
+	if (xu_init(4096) < 0)
+		return 1;
+
+	for (i = 0; i < sizeof(orders)/sizeof(orders[0]); i++) {
+		order = orders[i];
+		if (pipe(fds) < 0)
+			return 1;
+
+		rx = fork();
+		if (rx == 0)
+			exit(run_listener(fds[1]));
+		tx = fork();
+		if (tx == 0)
+			exit(run_connector(fds[0]));
+
+		close(fds[0]);
+		close(fds[1]);
+		if (waitpid(tx, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+		if (waitpid(rx, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+
+		printf("stress: order %2u, %lu entries + %lu packets %s\n",
+			order, num_pkts, num_pkts, ret ? "FAILED" : "ok");
+		fflush(stdout);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
@@ -0,0 +1,809 @@
+/*
+ *  XenLoop -- A High Performance Inter-VM Network Loopback
+ *
+ *  Userspace grant-table and event-channel backend
+ *
+ *  Authors:
+ *  	Jian Wang - Binghamton University (jianwang@cs.binghamton.edu)
+ *  	Kartik Gopalan - Binghamton University (kartik@cs.binghamton.edu)
+ *
+ *  Copyright (C) 2007-2009 Kartik Gopalan, Jian Wang
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "../debug.h"
+#include "../xenfifo.h"
+#include "../bififo.h"
+#include "../maptable.h"
+
+#define XU_CHN_FREE 		0
+#define XU_CHN_UNBOUND 		1
+#define XU_CHN_CONNECTED 	2
+
+/*
+ * Shared control block at the start of the arena.
+ * Page frames below XU_CTL_PAGES are never handed out, so gref 0 stays invalid.
+ */
+struct xu_ctl {
+	volatile uint32_t lock;
+	uint32_t num_pages;
+	uint8_t used[XU_MAX_PAGES];
+	domid_t owner[XU_MAX_PAGES];
+	domid_t granted[XU_MAX_PAGES]; /* grantee domid + 1, 0 if not granted */
+	uint16_t mapped[XU_MAX_PAGES]; /* mappings by the grantee */
+	struct {
+		uint8_t state;
+		domid_t ldom, rdom;
+	} chn[XU_MAX_CHANNELS];
+};
+
+#define XU_CTL_PAGES ((sizeof(struct xu_ctl) + PAGE_SIZE - 1) >> PAGE_SHIFT)
+
+/* Port 2k+1 is the unbound (listener) end of channel k, port 2k+2 the bound end */
+#define XU_NR_PORTS 		(2*XU_MAX_CHANNELS + 1)
+#define XU_PORT_CHN(port) 	(((port) - 1) >> 1)
+#define XU_PORT_PEER(port) 	(((port) & 1) ? (port) + 1 : (port) - 1)
+
+static int xu_memfd = -1;
+static uint8_t *xu_arena;
+static struct xu_ctl *xu_ctl;
+static domid_t xu_domid;
+static int xu_efd[XU_NR_PORTS];
+
+static struct {
+	irq_handler_t handler;
+	void *dev_id;
+	int masked;
+} xu_irq[XU_NR_PORTS];
+
+static struct tasklet_struct *xu_tasklets;
+static struct page xu_pages[XU_MAX_PAGES];
+
+unsigned long jiffies;
+void (*xu_rx_hook)(struct sk_buff *skb);
+unsigned long xu_notify_count;
+int xu_single_cpu;
+static struct xu_param *xu_params;
+
+/* Stand-ins for symbols that main.c provides to bififo.c */
+wait_queue_head_t swq;
+static struct net_device xu_nic = { .name = "xu0", .mtu = 1500 };
+struct net_device *NIC = &xu_nic;
+
+static void xu_lock(void)
+{
+	while (__atomic_exchange_n(&xu_ctl->lock, 1, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void xu_unlock(void)
+{
+	__atomic_store_n(&xu_ctl->lock, 0, __ATOMIC_RELEASE);
+}
+
+int xu_init(unsigned int num_pages)
+{
+	int i;
+
+	if (num_pages > XU_MAX_PAGES || num_pages <= XU_CTL_PAGES) {
+		EPRINTK("arena of %u pages not supported\n", num_pages);
+		return -1;
+	}
+
+	xu_memfd = memfd_create("xenloop-arena", 0);
+	if (xu_memfd < 0 || ftruncate(xu_memfd, (off_t)num_pages*PAGE_SIZE) < 0) {
+		EPRINTK("cannot create arena: %s\n", strerror(errno));
+		return -1;
+	}
+
+	xu_arena = mmap(NULL, num_pages*PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, xu_memfd, 0);
+	if (xu_arena == MAP_FAILED) {
+		EPRINTK("cannot map arena: %s\n", strerror(errno));
+		return -1;
+	}
+
+	xu_single_cpu = (sysconf(_SC_NPROCESSORS_ONLN) == 1);
+
+	xu_ctl = (struct xu_ctl *)xu_arena;
+	xu_ctl->num_pages = num_pages;
+	for (i = 0; i < XU_CTL_PAGES; i++)
+		xu_ctl->used[i] = 1;
+
+	for (i = 1; i < XU_NR_PORTS; i++) {
+		xu_efd[i] = eventfd(0, EFD_NONBLOCK);
+		if (xu_efd[i] < 0) {
+			EPRINTK("cannot create eventfd: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void xu_set_domid(domid_t domid)
+{
+	xu_domid = domid;
+}
+
+void xu_param_register(struct xu_param *param)
+{
+	param->next = xu_params;
+	xu_params = param;
+}
+
+int xu_set_param(const char *arg)
+{
+	const char *eq = strchr(arg, '='), *p;
+	struct xu_param *param;
+	int n;
+
+	if (!eq)
+		return -1;
+	for (param = xu_params; param; param = param->next)
+		if (strlen(param->name) == eq - arg && !strncmp(param->name, arg, eq - arg))
+			break;
+	if (!param)
+		return -1;
+
+	for (n = 0, p = eq; p && n < param->max; n++, p = strchr(p + 1, ','))
+		param->value[n] = atoi(p + 1);
+	if (param->num)
+		*param->num = n;
+	return 0;
+}
+
+/******************* Pages and grants **************************************/
+
+unsigned long __get_free_pages(int gfp, unsigned int order)
+{
+	unsigned int i, j, n = 1U << order;
+
+	xu_lock();
+	for (i = XU_CTL_PAGES; i + n <= xu_ctl->num_pages; i += n) {
+		for (j = 0; j < n && !xu_ctl->used[i+j]; j++)
+			;
+		if (j == n)
+			break;
+	}
+	if (i + n > xu_ctl->num_pages) {
+		xu_unlock();
+		return 0;
+	}
+	for (j = 0; j < n; j++) {
+		xu_ctl->used[i+j] = 1;
+		xu_ctl->owner[i+j] = xu_domid;
+		xu_pages[i+j].count = 0;
+	}
+	xu_unlock();
+	xu_pages[i].count = 1;
+
+	memset(xu_arena + i*PAGE_SIZE, 0, n*PAGE_SIZE);
+	return (unsigned long)(xu_arena + i*PAGE_SIZE);
+}
+
+void free_pages(unsigned long addr, unsigned int order)
+{
+	unsigned long i = virt_to_mfn((void *)addr);
+	unsigned int j;
+
+	xu_lock();
+	for (j = 0; j < (1U << order); j++) {
+		BUG_ON(xu_ctl->granted[i+j]);
+		xu_ctl->used[i+j] = 0;
+		xu_pages[i+j].count = 0;
+	}
+	xu_unlock();
+}
+
+struct page *virt_to_page(const void *va)
+{
+	return &xu_pages[virt_to_mfn((void *)va)];
+}
+
+unsigned long page_to_pfn(struct page *page)
+{
+	return page - xu_pages;
+}
+
+void *page_address(struct page *page)
+{
+	return xu_arena + (page - xu_pages)*PAGE_SIZE;
+}
+
+struct page *alloc_page(int gfp)
+{
+	unsigned long addr = __get_free_page(gfp);
+
+	return addr ? virt_to_page((void *)addr) : NULL;
+}
+
+void get_page(struct page *page)
+{
+	BUG_ON(page->count <= 0);
+	page->count++;
+}
+
+void put_page(struct page *page)
+{
+	BUG_ON(page->count <= 0);
+	if (--page->count == 0)
+		free_page((unsigned long)page_address(page));
+}
+
+unsigned long virt_to_mfn(void *va)
+{
+	uint8_t *p = va;
+
+	BUG_ON(p < xu_arena || p >= xu_arena + xu_ctl->num_pages*PAGE_SIZE);
+	return (p - xu_arena) >> PAGE_SHIFT;
+}
+
+int gnttab_grant_foreign_access(domid_t domid, unsigned long frame, int readonly)
+{
+	if (frame < XU_CTL_PAGES || frame >= xu_ctl->num_pages || !xu_ctl->used[frame])
+		return -EINVAL;
+
+	xu_ctl->granted[frame] = domid + 1;
+	return (int)frame;
+}
+
+/*
+ * As in the kernel, page, if not 0, is freed once access has ended, and
+ * both are leaked if the grantee still maps it
+ */
+void gnttab_end_foreign_access(grant_ref_t ref, unsigned long page)
+{
+	if (!gnttab_end_foreign_access_ref(ref)) {
+		EPRINTK("leaking gref %u and its page still in use\n", ref);
+		return;
+	}
+	if (page)
+		free_page(page);
+}
+
+/* A reference is its frame here, so it can only be reused for that frame */
+void gnttab_grant_foreign_access_ref(grant_ref_t ref, domid_t domid, unsigned long frame, int readonly)
+{
+	BUG_ON(ref != frame || gnttab_grant_foreign_access(domid, frame, readonly) < 0);
+}
+
+/* Returns 0, leaving the grant in place, while the grantee maps the page */
+int gnttab_end_foreign_access_ref(grant_ref_t ref)
+{
+	if (ref < XU_CTL_PAGES || ref >= xu_ctl->num_pages) {
+		EPRINTK("bad gref %u\n", ref);
+		return 1;
+	}
+	if (__atomic_load_n(&xu_ctl->mapped[ref], __ATOMIC_ACQUIRE))
+		return 0;
+	xu_ctl->granted[ref] = 0;
+	return 1;
+}
+
+int gnttab_query_foreign_access(grant_ref_t ref)
+{
+	if (ref < XU_CTL_PAGES || ref >= xu_ctl->num_pages)
+		return 0;
+	return __atomic_load_n(&xu_ctl->mapped[ref], __ATOMIC_ACQUIRE) != 0;
+}
+
+/* References are frames, so there is nothing to put back */
+void gnttab_free_grant_reference(grant_ref_t ref)
+{
+}
+
+struct vm_struct *alloc_vm_area(unsigned long size)
+{
+	struct vm_struct *area = malloc(sizeof(*area));
+
+	if (!area)
+		return NULL;
+
+	area->size = size;
+	area->addr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (area->addr == MAP_FAILED) {
+		free(area);
+		return NULL;
+	}
+	return area;
+}
+
+void free_vm_area(struct vm_struct *area)
+{
+	munmap(area->addr, area->size);
+	free(area);
+}
+
+static struct vm_struct *xu_vmaps;
+
+void *vmap(struct page **pages, unsigned int count, unsigned long flags, pgprot_t prot)
+{
+	struct vm_struct *area = alloc_vm_area(count*PAGE_SIZE);
+	unsigned int i;
+	void *va;
+
+	if (!area)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		va = mmap((uint8_t *)area->addr + i*PAGE_SIZE, PAGE_SIZE, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_FIXED, xu_memfd, (off_t)page_to_pfn(pages[i])*PAGE_SIZE);
+		if (va == MAP_FAILED) {
+			free_vm_area(area);
+			return NULL;
+		}
+	}
+
+	area->next = xu_vmaps;
+	xu_vmaps = area;
+	return area->addr;
+}
+
+void vunmap(void *addr)
+{
+	struct vm_struct **p, *area;
+
+	for (p = &xu_vmaps; (area = *p); p = &area->next)
+		if (area->addr == addr) {
+			*p = area->next;
+			free_vm_area(area);
+			return;
+		}
+	BUG();
+}
+
+static int16_t xu_map_one(gnttab_map_grant_ref_t *op)
+{
+	void *va;
+
+	if (op->ref < XU_CTL_PAGES || op->ref >= xu_ctl->num_pages)
+		return GNTST_bad_gntref;
+	if (xu_ctl->granted[op->ref] != xu_domid + 1 || xu_ctl->owner[op->ref] != op->dom)
+		return GNTST_bad_gntref;
+
+	va = mmap((void *)(unsigned long)op->host_addr, PAGE_SIZE, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_FIXED, xu_memfd, (off_t)op->ref*PAGE_SIZE);
+	if (va == MAP_FAILED)
+		return GNTST_bad_virt_addr;
+
+	__atomic_add_fetch(&xu_ctl->mapped[op->ref], 1, __ATOMIC_ACQ_REL);
+	op->handle = op->ref;
+	return GNTST_okay;
+}
+
+/* The source must be granted to us, the destination our own frame */
+static int16_t xu_copy_one(gnttab_copy_t *op)
+{
+	unsigned long src = op->source.u.ref, dst = op->dest.u.gmfn;
+
+	if (!(op->flags & GNTCOPY_source_gref) || op->dest.domid != DOMID_SELF)
+		return GNTST_general_error;
+	if (src < XU_CTL_PAGES || src >= xu_ctl->num_pages ||
+	    xu_ctl->granted[src] != xu_domid + 1 || xu_ctl->owner[src] != op->source.domid)
+		return GNTST_bad_gntref;
+	if (dst < XU_CTL_PAGES || dst >= xu_ctl->num_pages || xu_ctl->owner[dst] != xu_domid)
+		return GNTST_bad_virt_addr;
+	if (op->source.offset + op->len > PAGE_SIZE || op->dest.offset + op->len > PAGE_SIZE)
+		return GNTST_general_error;
+
+	memcpy(xu_arena + dst*PAGE_SIZE + op->dest.offset, 
+		xu_arena + src*PAGE_SIZE + op->source.offset, op->len);
+	return GNTST_okay;
+}
+
+static int16_t xu_unmap_one(gnttab_unmap_grant_ref_t *op)
+{
+	void *va;
+
+	if (op->handle < XU_CTL_PAGES || op->handle >= xu_ctl->num_pages)
+		return GNTST_bad_handle;
+
+	va = mmap((void *)(unsigned long)op->host_addr, PAGE_SIZE, PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE, -1, 0);
+	if (va == MAP_FAILED)
+		return GNTST_bad_virt_addr;
+
+	__atomic_sub_fetch(&xu_ctl->mapped[op->handle], 1, __ATOMIC_ACQ_REL);
+	return GNTST_okay;
+}
+
+int HYPERVISOR_grant_table_op(unsigned int cmd, void *uop, unsigned int count)
+{
+	unsigned int i;
+
+	switch (cmd) {
+	case GNTTABOP_map_grant_ref:
+		for (i = 0; i < count; i++) {
+			gnttab_map_grant_ref_t *op = (gnttab_map_grant_ref_t *)uop + i;
+			op->status = xu_map_one(op);
+		}
+		return 0;
+	case GNTTABOP_unmap_grant_ref:
+		for (i = 0; i < count; i++) {
+			gnttab_unmap_grant_ref_t *op = (gnttab_unmap_grant_ref_t *)uop + i;
+			op->status = xu_unmap_one(op);
+		}
+		return 0;
+	case GNTTABOP_copy:
+		for (i = 0; i < count; i++) {
+			gnttab_copy_t *op = (gnttab_copy_t *)uop + i;
+			op->status = xu_copy_one(op);
+		}
+		return 0;
+	}
+	return -ENOSYS;
+}
+
+/******************* Event channels ****************************************/
+
+static int xu_alloc_unbound(evtchn_alloc_unbound_t *op)
+{
+	int k;
+
+	xu_lock();
+	for (k = 0; k < XU_MAX_CHANNELS; k++) {
+		if (xu_ctl->chn[k].state == XU_CHN_FREE)
+			break;
+	}
+	if (k == XU_MAX_CHANNELS) {
+		xu_unlock();
+		return -ENOSPC;
+	}
+	xu_ctl->chn[k].state = XU_CHN_UNBOUND;
+	xu_ctl->chn[k].ldom = (op->dom == DOMID_SELF) ? xu_domid : op->dom;
+	xu_ctl->chn[k].rdom = op->remote_dom;
+	xu_unlock();
+
+	op->port = 2*k + 1;
+	return 0;
+}
+
+static int xu_bind_interdomain(evtchn_bind_interdomain_t *op)
+{
+	int k, ret = -EINVAL;
+
+	if (op->remote_port == 0 || op->remote_port >= XU_NR_PORTS || !(op->remote_port & 1))
+		return -EINVAL;
+	k = XU_PORT_CHN(op->remote_port);
+
+	xu_lock();
+	if (xu_ctl->chn[k].state == XU_CHN_UNBOUND &&
+	    xu_ctl->chn[k].ldom == op->remote_dom &&
+	    xu_ctl->chn[k].rdom == xu_domid) {
+		xu_ctl->chn[k].state = XU_CHN_CONNECTED;
+		op->local_port = op->remote_port + 1;
+		ret = 0;
+	}
+	xu_unlock();
+
+	return ret;
+}
+
+int HYPERVISOR_event_channel_op(int cmd, void *arg)
+{
+	uint64_t one = 1;
+	evtchn_port_t port;
+
+	switch (cmd) {
+	case EVTCHNOP_alloc_unbound:
+		return xu_alloc_unbound(arg);
+	case EVTCHNOP_bind_interdomain:
+		return xu_bind_interdomain(arg);
+	case EVTCHNOP_send:
+		port = ((evtchn_send_t *)arg)->port;
+		if (port == 0 || port >= XU_NR_PORTS)
+			return -EINVAL;
+		xu_notify_count++;
+		if (xu_ctl->chn[XU_PORT_CHN(port)].state != XU_CHN_CONNECTED)
+			return 0;
+		if (write(xu_efd[XU_PORT_PEER(port)], &one, sizeof(one)) != sizeof(one))
+			return -errno;
+		return 0;
+	case EVTCHNOP_close:
+		port = ((evtchn_close_t *)arg)->port;
+		if (port == 0 || port >= XU_NR_PORTS)
+			return -EINVAL;
+		xu_ctl->chn[XU_PORT_CHN(port)].state = XU_CHN_FREE;
+		return 0;
+	}
+	return -ENOSYS;
+}
+
+int bind_caller_port_to_irqhandler(unsigned int port, irq_handler_t handler,
+				unsigned long irqflags, const char *devname, void *dev_id)
+{
+	if (port == 0 || port >= XU_NR_PORTS || xu_irq[port].handler)
+		return -EINVAL;
+
+	xu_irq[port].handler = handler;
+	xu_irq[port].dev_id = dev_id;
+	return port;
+}
+
+void unbind_from_irqhandler(unsigned int irq, void *dev_id)
+{
+	if (irq == 0 || irq >= XU_NR_PORTS || xu_irq[irq].dev_id != dev_id)
+		return;
+
+	xu_irq[irq].handler = NULL;
+	xu_irq[irq].dev_id = NULL;
+	xu_irq[irq].masked = 0;
+}
+
+/* A masked port keeps its eventfd count, so unmasking delivers what arrived meanwhile */
+void mask_evtchn(int port)
+{
+	if (port > 0 && port < XU_NR_PORTS)
+		xu_irq[port].masked = 1;
+}
+
+void unmask_evtchn(int port)
+{
+	if (port > 0 && port < XU_NR_PORTS)
+		xu_irq[port].masked = 0;
+}
+
+void tasklet_init(struct tasklet_struct *t, void (*func)(unsigned long), unsigned long data)
+{
+	t->next = NULL;
+	t->scheduled = 0;
+	t->func = func;
+	t->data = data;
+}
+
+void tasklet_schedule(struct tasklet_struct *t)
+{
+	struct tasklet_struct **pp;
+
+	if (t->scheduled)
+		return;
+	t->scheduled = 1;
+	t->next = NULL;
+	for (pp = &xu_tasklets; *pp; pp = &(*pp)->next)
+		;
+	*pp = t;
+}
+
+void tasklet_kill(struct tasklet_struct *t)
+{
+	struct tasklet_struct **pp;
+
+	for (pp = &xu_tasklets; *pp; pp = &(*pp)->next) {
+		if (*pp == t) {
+			*pp = t->next;
+			break;
+		}
+	}
+	t->scheduled = 0;
+}
+
+static struct timer_list *xu_timers;
+
+void init_timer(struct timer_list *t)
+{
+	t->next = NULL;
+	t->pending = 0;
+}
+
+int del_timer_sync(struct timer_list *t)
+{
+	struct timer_list **pp;
+	int was = t->pending;
+
+	for (pp = &xu_timers; *pp; pp = &(*pp)->next) {
+		if (*pp == t) {
+			*pp = t->next;
+			break;
+		}
+	}
+	t->pending = 0;
+	return was;
+}
+
+int mod_timer(struct timer_list *t, unsigned long expires)
+{
+	int was = del_timer_sync(t);
+
+	t->expires = expires;
+	t->pending = 1;
+	t->next = xu_timers;
+	xu_timers = t;
+	return was;
+}
+
+static int xu_run_timers(void)
+{
+	struct timer_list **pp = &xu_timers, *t;
+	int ran = 0;
+
+	while ((t = *pp)) {
+		if (!time_after_eq(jiffies, t->expires)) {
+			pp = &t->next;
+			continue;
+		}
+		/* The function may re-add the timer, so start over */
+		*pp = t->next;
+		t->pending = 0;
+		t->function(t->data);
+		ran++;
+		pp = &xu_timers;
+	}
+	return ran;
+}
+
+static int xu_run_tasklets(void)
+{
+	struct tasklet_struct *list = xu_tasklets, *t;
+	int ran = 0;
+
+	/* Tasklets rescheduled while running go on the next pass */
+	xu_tasklets = NULL;
+	while ((t = list)) {
+		list = t->next;
+		t->scheduled = 0;
+		t->func(t->data);
+		ran++;
+	}
+	return ran;
+}
+
+static int xu_poll_once(int timeout_ms)
+{
+	struct pollfd pfd[XU_NR_PORTS];
+	int port[XU_NR_PORTS];
+	int i, n = 0, ret, handled = 0;
+	uint64_t count;
+
+	for (i = 1; i < XU_NR_PORTS; i++) {
+		if (!xu_irq[i].handler || xu_irq[i].masked)
+			continue;
+		pfd[n].fd = xu_efd[i];
+		pfd[n].events = POLLIN;
+		port[n++] = i;
+	}
+
+	if (xu_tasklets)
+		timeout_ms = 0;
+	else if (xu_timers && (timeout_ms < 0 || timeout_ms > 1))
+		timeout_ms = 1;
+
+	ret = poll(pfd, n, timeout_ms);
+	if (ret < 0)
+		return ret;
+	jiffies = get_cycles()/1000000;
+
+	for (i = 0; ret && i < n; i++) {
+		if (!(pfd[i].revents & POLLIN))
+			continue;
+		if (read(pfd[i].fd, &count, sizeof(count)) != sizeof(count))
+			continue;
+		if (xu_irq[port[i]].handler) {
+			xu_irq[port[i]].handler(port[i], xu_irq[port[i]].dev_id, NULL);
+			handled++;
+		}
+	}
+
+	handled += xu_run_timers();
+	return handled + xu_run_tasklets();
+}
+
+/* A pending timer cuts each wait short, so wait again until the timeout */
+int xu_poll(int timeout_ms)
+{
+	unsigned long end = get_cycles()/1000000 + timeout_ms;
+	int ret;
+
+	while (!(ret = xu_poll_once(timeout_ms)) && xu_timers && timeout_ms) {
+		if (timeout_ms < 0)
+			continue;
+		if (time_after_eq(jiffies, end))
+			break;
+		timeout_ms = end - jiffies;
+	}
+	return ret;
+}
+
+/******************* Socket buffers ****************************************/
+
+/* Data comes from the arena, as kmalloc memory can be granted in a guest */
+struct sk_buff *alloc_skb(unsigned int size, int gfp)
+{
+	struct sk_buff *skb = malloc(sizeof(*skb));
+
+	if (!skb)
+		return NULL;
+
+	memset(skb, 0, sizeof(*skb));
+	skb->head = (unsigned char *)__get_free_pages(gfp, get_order(size));
+	if (!skb->head) {
+		free(skb);
+		return NULL;
+	}
+	skb->data = skb->tail = skb->head;
+	skb->end = skb->head + size;
+	return skb;
+}
+
+void kfree_skb(struct sk_buff *skb)
+{
+	int i;
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
+		put_page(skb_shinfo(skb)->frags[i].page);
+	free_pages((unsigned long)skb->head, get_order(skb->end - skb->head));
+	free(skb);
+}
+
+int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len)
+{
+	unsigned int headlen = skb->len - skb->data_len;
+	const skb_frag_t *frag;
+	int i, copy;
+
+	if (offset < 0 || len < 0 || offset + len > skb->len)
+		return -EFAULT;
+
+	if (offset < headlen) {
+		copy = headlen - offset < len ? headlen - offset : len;
+		memcpy(to, skb->data + offset, copy);
+		to = (uint8_t *)to + copy;
+		len -= copy;
+		offset += copy;
+	}
+	offset -= headlen;
+
+	for (i = 0; len > 0 && i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		if (offset >= frag->size) {
+			offset -= frag->size;
+			continue;
+		}
+		copy = frag->size - offset < len ? frag->size - offset : len;
+		memcpy(to, (uint8_t *)page_address(frag->page) + frag->page_offset + offset, copy);
+		to = (uint8_t *)to + copy;
+		len -= copy;
+		offset = 0;
+	}
+	return 0;
+}
+
+int netif_rx(struct sk_buff *skb)
+{
+	if (xu_rx_hook)
+		xu_rx_hook(skb);
+	else
+		kfree_skb(skb);
+	return 0;
+}
+
+int netif_receive_skb(struct sk_buff *skb)
+{
+	return netif_rx(skb);
+}
@@ -0,0 +1,525 @@
+/*
+ *  XenLoop -- A High Performance Inter-VM Network Loopback
+ *
+ *  Userspace stand-ins for the kernel and Xen interfaces used by the FIFO code
+ *
+ *  Authors:
+ *  	Jian Wang - Binghamton University (jianwang@cs.binghamton.edu)
+ *  	Kartik Gopalan - Binghamton University (kartik@cs.binghamton.edu)
+ *
+ *  Copyright (C) 2007-2009 Kartik Gopalan, Jian Wang
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef _XEN_USER_H_
+#define _XEN_USER_H_
+
+/*
+ * Compiled in only when XENLOOP_USER is defined.
+ *
+ * The grant table is emulated by one memfd "arena" that is mapped by every
+ * process forked after xu_init(). FIFO pages are allocated from the arena,
+ * a grant reference is simply the page frame number within the arena, and
+ * mapping a grant mmap()s that frame of the memfd into the caller's
+ * vm area. Event channels are pairs of eventfds; xu_poll() dispatches
+ * pending events to the handlers bound with bind_caller_port_to_irqhandler().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef uint16_t domid_t;
+typedef uint32_t grant_ref_t;
+typedef uint32_t grant_handle_t;
+
+#define DOMID_SELF 		((domid_t)0x7FF0U)
+
+#define PAGE_SHIFT 		12
+#define PAGE_SIZE 		(1UL << PAGE_SHIFT)
+#define PAGE_MASK 		(~(PAGE_SIZE-1))
+#define offset_in_page(p) 	((unsigned long)(p) & ~PAGE_MASK)
+
+#define GFP_KERNEL 		0
+#define GFP_ATOMIC 		1
+
+#define KERN_CRIT 		""
+#define printk(fmt, args...) 	fprintf(stderr, fmt, ## args)
+
+#define BUG() 			do { fprintf(stderr, "BUG at %s:%d\n", __FILE__, __LINE__); abort(); } while (0)
+#define BUG_ON(cond) 		do { if (cond) BUG(); } while (0)
+#define WARN_ON(cond) 		((cond) ? fprintf(stderr, "WARNING at %s:%d\n", __FILE__, __LINE__) : 0)
+
+#if defined(__i386__) || defined(__x86_64__)
+#define xu_cpu_pause() 		__asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define xu_cpu_pause() 		__asm__ __volatile__("yield" ::: "memory")
+#else
+#define xu_cpu_pause() 		__asm__ __volatile__("" ::: "memory")
+#endif
+
+/* On a single CPU a spinning process only holds off the one it waits for */
+extern int xu_single_cpu;
+#define cpu_relax() 		do { if (xu_single_cpu) sched_yield(); else xu_cpu_pause(); } while (0)
+
+#define barrier() 		__asm__ __volatile__("" ::: "memory")
+#define mb() 			__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define rmb() 			__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define wmb() 			__atomic_thread_fence(__ATOMIC_RELEASE)
+
+#define min(x, y) 		((x) < (y) ? (x) : (y))
+
+#define likely(x) 		__builtin_expect(!!(x), 1)
+#define unlikely(x) 		__builtin_expect(!!(x), 0)
+
+#define kmalloc(size, flags) 	malloc(size)
+#define kfree(p) 		free(p)
+
+/* jiffies counts milliseconds; xu_poll() brings it up to date */
+#define HZ 			1000
+extern unsigned long jiffies;
+#define time_after_eq(a, b) 	((long)((a) - (b)) >= 0)
+#define usecs_to_jiffies(u) 	(((unsigned long)(u) + 999)/1000)
+
+/* The cycle counter ticks in nanoseconds */
+typedef unsigned long long cycles_t;
+#define cpu_khz 		1000000U
+static inline cycles_t get_cycles(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (cycles_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/******************* Spinlocks (process-local) *****************************/
+
+typedef pthread_mutex_t spinlock_t;
+#define DEFINE_SPINLOCK(x) 	spinlock_t x = PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(l) 	pthread_mutex_init(l, NULL)
+#define spin_lock(l) 		pthread_mutex_lock(l)
+#define spin_unlock(l) 		pthread_mutex_unlock(l)
+#define spin_lock_irqsave(l, flags) 	do { (flags) = 0; pthread_mutex_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags) do { (void)(flags); pthread_mutex_unlock(l); } while (0)
+
+typedef int wait_queue_head_t;
+#define wake_up_interruptible(wq) do { (void)(wq); } while (0)
+
+/******************* Lists *************************************************/
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define INIT_LIST_HEAD(ptr) do { (ptr)->next = (ptr); (ptr)->prev = (ptr); } while (0)
+#define list_empty(head) 	((head)->next == (head))
+#define list_entry(ptr, type, member) \
+	((type *)((char *)(ptr) - (unsigned long)(&((type *)0)->member)))
+#define list_for_each(pos, head) \
+	for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_for_each_safe(pos, n, head) \
+	for (pos = (head)->next, n = pos->next; pos != (head); pos = n, n = pos->next)
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	new->next = head->next;
+	new->prev = head;
+	head->next->prev = new;
+	head->next = new;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+}
+
+typedef struct kmem_cache kmem_cache_t;
+
+/******************* Emulated grant table **********************************/
+
+#define XU_MAX_PAGES 		16384
+#define XU_MAX_CHANNELS 	64
+
+struct vm_struct {
+	void *addr;
+	unsigned long size;
+	struct vm_struct *next; /* vmap areas, so vunmap can find the size */
+};
+
+extern unsigned long __get_free_pages(int gfp, unsigned int order);
+extern void free_pages(unsigned long addr, unsigned int order);
+#define __get_free_page(gfp) 	__get_free_pages(gfp, 0)
+#define get_zeroed_page(gfp) 	__get_free_pages(gfp, 0)
+#define free_page(addr) 	free_pages(addr, 0)
+
+extern unsigned long virt_to_mfn(void *va);
+
+/*
+ * Arena pages carry a per-process reference count. As in the kernel, only 
+ * the first page of a higher-order allocation is counted.
+ */
+struct page {
+	int count;
+};
+
+extern struct page *virt_to_page(const void *va);
+extern void *page_address(struct page *page);
+extern struct page *alloc_page(int gfp);
+extern void get_page(struct page *page);
+extern void put_page(struct page *page);
+#define page_count(page) 	((page)->count)
+extern unsigned long page_to_pfn(struct page *page);
+#define pfn_to_mfn(pfn) 	(pfn)
+#define __free_page(page) 	put_page(page)
+
+extern struct vm_struct *alloc_vm_area(unsigned long size);
+extern void free_vm_area(struct vm_struct *area);
+
+/* vmap maps the arena frames of the pages in a row, as a grant map would */
+typedef int pgprot_t;
+#define VM_MAP 			0
+#define PAGE_KERNEL 		0
+extern void *vmap(struct page **pages, unsigned int count, unsigned long flags, pgprot_t prot);
+extern void vunmap(void *addr);
+
+static inline unsigned int get_order(unsigned long size)
+{
+	unsigned int order = 0;
+
+	size = (size - 1) >> PAGE_SHIFT;
+	while (size) {
+		size >>= 1;
+		order++;
+	}
+	return order;
+}
+
+extern int gnttab_grant_foreign_access(domid_t domid, unsigned long frame, int readonly);
+extern void gnttab_end_foreign_access(grant_ref_t ref, unsigned long page);
+extern void gnttab_grant_foreign_access_ref(grant_ref_t ref, domid_t domid, unsigned long frame, int readonly);
+extern int gnttab_end_foreign_access_ref(grant_ref_t ref);
+extern int gnttab_query_foreign_access(grant_ref_t ref);
+extern void gnttab_free_grant_reference(grant_ref_t ref);
+
+#define GNTMAP_host_map 	(1 << 1)
+#define GNTMAP_readonly 	(1 << 2)
+
+#define GNTST_okay 		(0)
+#define GNTST_general_error 	(-1)
+#define GNTST_bad_domain 	(-2)
+#define GNTST_bad_gntref 	(-3)
+#define GNTST_bad_handle 	(-4)
+#define GNTST_bad_virt_addr 	(-5)
+
+#define GNTTABOP_map_grant_ref 		0
+#define GNTTABOP_unmap_grant_ref 	1
+#define GNTTABOP_copy 			5
+
+#define GNTCOPY_source_gref 	(1 << 0)
+
+typedef struct gnttab_map_grant_ref {
+	uint64_t host_addr;
+	uint32_t flags;
+	grant_ref_t ref;
+	domid_t dom;
+	int16_t status;
+	grant_handle_t handle;
+	uint64_t dev_bus_addr;
+} gnttab_map_grant_ref_t;
+
+typedef struct gnttab_unmap_grant_ref {
+	uint64_t host_addr;
+	uint64_t dev_bus_addr;
+	grant_handle_t handle;
+	int16_t status;
+} gnttab_unmap_grant_ref_t;
+
+typedef struct gnttab_copy {
+	struct {
+		union {
+			grant_ref_t ref;
+			unsigned long gmfn;
+		} u;
+		domid_t domid;
+		uint16_t offset;
+	} source, dest;
+	uint16_t len;
+	uint16_t flags;
+	int16_t status;
+} gnttab_copy_t;
+
+static inline void gnttab_set_map_op(gnttab_map_grant_ref_t *map, unsigned long addr,
+				uint32_t flags, grant_ref_t ref, domid_t domid)
+{
+	map->host_addr = addr;
+	map->flags = flags;
+	map->ref = ref;
+	map->dom = domid;
+}
+
+static inline void gnttab_set_unmap_op(gnttab_unmap_grant_ref_t *unmap, unsigned long addr,
+				uint32_t flags, grant_handle_t handle)
+{
+	unmap->host_addr = addr;
+	unmap->handle = handle;
+	unmap->dev_bus_addr = 0;
+	(void)flags;
+}
+
+extern int HYPERVISOR_grant_table_op(unsigned int cmd, void *uop, unsigned int count);
+
+/******************* Emulated event channels *******************************/
+
+#define EVTCHNOP_bind_interdomain 	0
+#define EVTCHNOP_close 			3
+#define EVTCHNOP_send 			4
+#define EVTCHNOP_alloc_unbound 		6
+
+typedef uint32_t evtchn_port_t;
+
+typedef struct evtchn_alloc_unbound {
+	domid_t dom, remote_dom;
+	evtchn_port_t port;
+} evtchn_alloc_unbound_t;
+
+typedef struct evtchn_bind_interdomain {
+	domid_t remote_dom;
+	evtchn_port_t remote_port;
+	evtchn_port_t local_port;
+} evtchn_bind_interdomain_t;
+
+typedef struct evtchn_send {
+	evtchn_port_t port;
+} evtchn_send_t;
+
+typedef struct evtchn_close {
+	evtchn_port_t port;
+} evtchn_close_t;
+
+extern int HYPERVISOR_event_channel_op(int cmd, void *op);
+
+typedef int irqreturn_t;
+#define IRQ_NONE 		0
+#define IRQ_HANDLED 		1
+#define SA_SAMPLE_RANDOM 	0
+
+struct pt_regs;
+typedef irqreturn_t (*irq_handler_t)(int, void *, struct pt_regs *);
+
+extern int bind_caller_port_to_irqhandler(unsigned int port, irq_handler_t handler,
+				unsigned long irqflags, const char *devname, void *dev_id);
+extern void unbind_from_irqhandler(unsigned int irq, void *dev_id);
+extern void mask_evtchn(int port);
+extern void unmask_evtchn(int port);
+
+/*
+ * Tasklets run from xu_poll() in the process that scheduled them, after
+ * the event handlers; a tasklet scheduled while queued runs once.
+ */
+struct tasklet_struct {
+	struct tasklet_struct *next;
+	int scheduled;
+	void (*func)(unsigned long);
+	unsigned long data;
+};
+
+extern void tasklet_init(struct tasklet_struct *t, void (*func)(unsigned long), unsigned long data);
+extern void tasklet_schedule(struct tasklet_struct *t);
+extern void tasklet_kill(struct tasklet_struct *t);
+
+/*
+ * Timers run from xu_poll() too, before the tasklets, once jiffies has 
+ * reached their expiry.
+ */
+struct timer_list {
+	struct timer_list *next;
+	int pending;
+	unsigned long expires;
+	void (*function)(unsigned long);
+	unsigned long data;
+};
+
+extern void init_timer(struct timer_list *t);
+extern int mod_timer(struct timer_list *t, unsigned long expires);
+extern int del_timer_sync(struct timer_list *t);
+#define timer_pending(t) 	((t)->pending)
+
+/*
+ * An int module parameter, or array of them, registers itself with the 
+ * harness, which sets it from a name=value[,value...] argument, as insmod 
+ * would; see xu_set_param.
+ */
+struct xu_param {
+	const char *name;
+	int *value;
+	int *num; 	/* values given, for an array */
+	int max;
+	struct xu_param *next;
+};
+
+extern void xu_param_register(struct xu_param *param);
+
+#define __xu_param(name, value, num, max) \
+	static struct xu_param __xu_param_##name; \
+	static void __attribute__((constructor)) __xu_param_init_##name(void) \
+	{ xu_param_register(&__xu_param_##name); } \
+	static struct xu_param __xu_param_##name = { #name, value, num, max, NULL }
+#define module_param(name, type, perm) \
+	__xu_param(name, &name, NULL, 1)
+#define module_param_array(name, type, nump, perm) \
+	__xu_param(name, name, nump, sizeof(name)/sizeof(name[0]))
+#define MODULE_PARM_DESC(name, desc)
+
+/******************* Minimal socket buffers ********************************/
+
+#ifndef ETH_ALEN
+#define ETH_ALEN 		6
+#endif
+#ifndef ETH_HLEN
+#define ETH_HLEN 		14
+#endif
+#ifndef ETH_P_IP
+#define ETH_P_IP 		0x0800
+#endif
+
+#define CHECKSUM_UNNECESSARY 	2
+#define PACKET_HOST 		0
+#define MAX_SKB_FRAGS 		18
+
+#define SKB_GSO_TCPV4 		(1 << 0)
+#define SKB_GSO_UDP 		(1 << 1)
+#define SKB_GSO_DODGY 		(1 << 2)
+#define SKB_GSO_TCP_ECN 	(1 << 3)
+#define SKB_GSO_TCPV6 		(1 << 4)
+
+typedef struct skb_frag_struct {
+	struct page *page;
+	uint16_t page_offset;
+	uint16_t size;
+} skb_frag_t;
+
+struct skb_shared_info {
+	unsigned short nr_frags;
+	unsigned short gso_size;
+	unsigned short gso_segs;
+	unsigned short gso_type;
+	struct sk_buff *frag_list;
+	skb_frag_t frags[MAX_SKB_FRAGS];
+};
+
+struct net_device {
+	char name[16];
+	unsigned char dev_addr[ETH_ALEN];
+	unsigned int mtu;
+	unsigned long last_rx;
+};
+
+struct sk_buff {
+	struct sk_buff *next;
+	struct net_device *dev;
+	union {
+		unsigned char *raw;
+	} mac;
+	unsigned int len, data_len, truesize;
+	uint8_t ip_summed, pkt_type;
+	uint16_t protocol;
+	unsigned char *head, *data, *tail, *end;
+	struct skb_shared_info shinfo;
+};
+
+#define skb_shinfo(skb) 	(&(skb)->shinfo)
+
+extern struct sk_buff *alloc_skb(unsigned int size, int gfp);
+extern void kfree_skb(struct sk_buff *skb);
+extern int skb_copy_bits(const struct sk_buff *skb, int offset, void *to, int len);
+extern int netif_rx(struct sk_buff *skb);
+extern int netif_receive_skb(struct sk_buff *skb);
+
+static inline void skb_reserve(struct sk_buff *skb, int len)
+{
+	skb->data += len;
+	skb->tail += len;
+}
+
+static inline void skb_fill_page_desc(struct sk_buff *skb, int i, struct page *page, int off, int size)
+{
+	skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+
+	frag->page = page;
+	frag->page_offset = off;
+	frag->size = size;
+	skb_shinfo(skb)->nr_frags = i + 1;
+}
+
+#define skb_headlen(skb) 	((skb)->len - (skb)->data_len)
+
+static inline unsigned char *skb_put(struct sk_buff *skb, unsigned int len)
+{
+	unsigned char *tmp = skb->tail;
+
+	BUG_ON(skb->data_len);
+	skb->tail += len;
+	skb->len  += len;
+	BUG_ON(skb->tail > skb->end);
+	return tmp;
+}
+
+/******************* Harness control ***************************************/
+
+/*
+ * xu_init must be called once before fork() so that every process
+ * shares the same arena and eventfds. xu_set_domid gives each process
+ * its own domain id. xu_poll waits up to timeout_ms (-1 = forever) for
+ * events on unmasked ports, runs the bound handlers, any expired timers and
+ * then any scheduled tasklets; it returns the number of those run, does
+ * not sleep while a tasklet is pending and wakes up as a timer expires.
+ * It returns 0 only once timeout_ms has passed. xu_rx_hook receives every skb
+ * passed to netif_rx or netif_receive_skb (freed if NULL).
+ * xu_notify_count counts the events this process has sent. xu_set_param 
+ * sets a module parameter from "name=value" and returns -1 if there is 
+ * no such parameter.
+ */
+extern int xu_init(unsigned int num_pages);
+extern void xu_set_domid(domid_t domid);
+extern int xu_poll(int timeout_ms);
+extern void (*xu_rx_hook)(struct sk_buff *skb);
+extern unsigned long xu_notify_count;
+extern int xu_set_param(const char *arg);
+
+#endif /* _XEN_USER_H_ */
@@ -0,0 +1,516 @@
+/*
+ *  XenLoop -- A High Performance Inter-VM Network Loopback
+ *
+ *  FIFO microbenchmark: throughput, one-way latency and PMU counters
+ *
+ *  Authors:
+ *  	Jian Wang - Binghamton University (jianwang@cs.binghamton.edu)
+ *  	Kartik Gopalan - Binghamton University (kartik@cs.binghamton.edu)
+ *
+ *  Copyright (C) 2007-2009 Kartik Gopalan, Jian Wang
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Every run forks a listener (consumer) and a connector (producer) that
+ * share one bififo direction, exactly as two guests would. Three modes:
+ *
+ *   idx   - xf_back/xf_push against xf_front/xf_pop, one 64-byte slot
+ *           per packet; isolates the index and cache-line traffic.
+ *   idxn  - xf_pushn/xf_popn of a whole packet's worth of entries
+ *           with no payload copy; the bookkeeping cost per packet.
+ *   pkt   - xmit_large_pkt against recv_packets/copy_large_pkt; the
+ *           full copy path that XenLoop uses.
+ *
+ * Each run first streams packets as fast as possible (Mpps, GB/s and
+ * per-packet PMU counts) and then sends one packet at a time into an
+ * empty ring to sample unloaded one-way latency. Both sides busy-poll;
+ * event channels are not involved.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../debug.h"
+#include "../xenfifo.h"
+#include "../bififo.h"
+
+#define LISTENER_DOMID 	1
+#define CONNECTOR_DOMID 2
+
+#define MODE_IDX 	0
+#define MODE_IDXN 	1
+#define MODE_PKT 	2
+
+#define LAT_SAMPLES 	20000
+#define MAX_PKT_BYTES 	(1UL << 30)	/* per throughput pass */
+#define NR_COUNTERS 	2		/* LLC read misses, branch misses */
+
+static const char *mode_names[] = { "idx", "idxn", "pkt" };
+
+struct run_result {
+	uint64_t t_start, t_end;
+	int64_t tx_count[NR_COUNTERS], rx_count[NR_COUNTERS];
+	uint32_t nlat;
+	uint32_t lat[LAT_SAMPLES];
+};
+
+struct chn_msg {
+	int gref_in;
+	int gref_out;
+	int remote_port;
+};
+
+static struct run_result *res;
+static int mode;
+static unsigned int pkt_size;
+static unsigned long num_pkts;
+static unsigned long nlat_pkts = LAT_SAMPLES;
+static int tx_cpu = -1, rx_cpu = -1;
+static int single_cpu;
+
+static unsigned long rx_seen;
+static int rx_timing;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t since_start(void)
+{
+	return (uint32_t)(now_ns() - res->t_start);
+}
+
+static inline void relax(void)
+{
+	if (single_cpu)
+		sched_yield();
+	else
+		cpu_relax();
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		EPRINTK("cannot pin to cpu %d\n", cpu);
+}
+
+/******************* PMU counters ******************************************/
+
+static void counters_open(int *fd)
+{
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < NR_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.disabled = 1;
+		attr.exclude_hv = 1;
+		if (i == 0) {
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_LL |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		} else {
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		}
+		fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+}
+
+static void counters_enable(int *fd)
+{
+	int i;
+
+	for (i = 0; i < NR_COUNTERS; i++)
+		if (fd[i] >= 0)
+			ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static void counters_read(int *fd, int64_t *count)
+{
+	int i;
+
+	for (i = 0; i < NR_COUNTERS; i++) {
+		count[i] = -1;
+		if (fd[i] < 0)
+			continue;
+		ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd[i], &count[i], sizeof(count[i])) != sizeof(count[i]))
+			count[i] = -1;
+		close(fd[i]);
+	}
+}
+
+/******************* Consumer (listener) ***********************************/
+
+static inline unsigned int pkt_entries(void)
+{
+	return BF_PKT_ENTRIES(pkt_size);
+}
+
+/* Timestamps are ns since res->t_start, modulo 2^32 */
+static void record(uint32_t sent)
+{
+	if (rx_timing && res->nlat < LAT_SAMPLES)
+		res->lat[res->nlat++] = since_start() - sent;
+	if (++rx_seen == num_pkts) {
+		res->t_end = now_ns();
+		rx_timing = 1;
+	}
+}
+
+static void rx_hook(struct sk_buff *skb)
+{
+	uint32_t sent;
+
+	memcpy(&sent, skb->data, sizeof(sent));
+	record(sent);
+	kfree_skb(skb);
+}
+
+static int run_listener(int wfd, unsigned int order)
+{
+	unsigned long total = num_pkts + nlat_pkts;
+	int fd[NR_COUNTERS], counted = 0;
+	struct chn_msg msg;
+	bf_handle_t *bfl;
+	bf_data_t *d;
+	xf_handle_t *in;
+
+	xu_set_domid(LISTENER_DOMID);
+	xu_rx_hook = rx_hook;
+	pin(rx_cpu);
+
+	bfl = bf_create(CONNECTOR_DOMID, order);
+	if (!bfl)
+		return 1;
+	in = bfl->in;
+
+	msg.gref_in = BF_GREF_IN(bfl);
+	msg.gref_out = BF_GREF_OUT(bfl);
+	msg.remote_port = BF_EVT_PORT(bfl);
+	if (write(wfd, &msg, sizeof(msg)) != sizeof(msg))
+		return 1;
+
+	counters_open(fd);
+	counters_enable(fd);
+
+	while (rx_seen < total) {
+		switch (mode) {
+		case MODE_IDX:
+			if (!(d = xf_front(in, bf_data_t))) {
+				relax();
+				continue;
+			}
+			record(d->pkt_info);
+			xf_pop(in);
+			break;
+		case MODE_IDXN:
+			if (xf_empty(in)) {
+				relax();
+				continue;
+			}
+			d = xf_front(in, bf_data_t);
+			record(d->pkt_info);
+			xf_popn(in, pkt_entries());
+			break;
+		case MODE_PKT:
+			if (xf_empty(in)) {
+				relax();
+				continue;
+			}
+			recv_packets(bfl, 64);
+			break;
+		}
+		if (rx_seen >= num_pkts && !counted) {
+			counters_read(fd, res->rx_count);
+			counted = 1;
+		}
+	}
+
+	bf_destroy(bfl);
+	return 0;
+}
+
+/******************* Producer (connector) **********************************/
+
+static int send_one(xf_handle_t *out, struct sk_buff *skb)
+{
+	bf_data_t *d;
+	uint32_t t;
+
+	switch (mode) {
+	case MODE_IDX:
+		if (!(d = xf_back(out, bf_data_t)))
+			return -1;
+		d->pkt_info = since_start();
+		xf_push(out);
+		return 0;
+	case MODE_IDXN:
+		if (!xf_has_free(out, pkt_entries()))
+			return -1;
+		d = xf_back_entry(out, bf_data_t, 0);
+		d->pkt_info = since_start();
+		xf_pushn(out, pkt_entries());
+		return 0;
+	case MODE_PKT:
+		t = since_start();
+		memcpy(skb->data, &t, sizeof(t));
+		return xmit_large_pkt(skb, out);
+	}
+	return -1;
+}
+
+static int run_connector(int rfd)
+{
+	int fd[NR_COUNTERS];
+	struct chn_msg msg;
+	struct sk_buff *skb;
+	bf_handle_t *bfc;
+	unsigned long i;
+
+	xu_set_domid(CONNECTOR_DOMID);
+	pin(tx_cpu);
+
+	if (read(rfd, &msg, sizeof(msg)) != sizeof(msg))
+		return 1;
+
+	bfc = bf_connect(LISTENER_DOMID, msg.gref_out, msg.gref_in, msg.remote_port);
+	if (!bfc)
+		return 1;
+
+	skb = alloc_skb(pkt_size, GFP_KERNEL);
+	BUG_ON(!skb);
+	skb_put(skb, pkt_size);
+	memset(skb->data, 0xa5, pkt_size);
+
+	counters_open(fd);
+	res->t_start = now_ns();
+	counters_enable(fd);
+
+	for (i = 0; i < num_pkts; i++)
+		while (send_one(bfc->out, skb) < 0)
+			relax();
+
+	counters_read(fd, res->tx_count);
+
+	for (i = 0; i < nlat_pkts; i++) {
+		while (xf_size(bfc->out))
+			relax();
+		while (send_one(bfc->out, skb) < 0)
+			relax();
+	}
+	while (xf_size(bfc->out))
+		relax();
+
+	kfree_skb(skb);
+	bf_disconnect(bfc);
+	return 0;
+}
+
+/******************* Driver ************************************************/
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void print_count(int64_t count)
+{
+	if (count < 0)
+		printf(" %8s", "-");
+	else
+		printf(" %8.3f", (double)count/num_pkts);
+}
+
+static int run_one(unsigned int order)
+{
+	pid_t rx, tx;
+	int fds[2], status, ret = 0;
+	double secs;
+
+	memset(res, 0, sizeof(*res));
+	fflush(stdout);
+	if (pipe(fds) < 0)
+		return -1;
+
+	rx = fork();
+	if (rx == 0)
+		exit(run_listener(fds[1], order));
+	tx = fork();
+	if (tx == 0)
+		exit(run_connector(fds[0]));
+
+	close(fds[0]);
+	close(fds[1]);
+	if (waitpid(tx, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		ret = -1;
+	if (waitpid(rx, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		ret = -1;
+	if (ret < 0) {
+		EPRINTK("%s order %u size %u failed\n", mode_names[mode], order, pkt_size);
+		return -1;
+	}
+
+	secs = (res->t_end - res->t_start)/1e9;
+	qsort(res->lat, res->nlat, sizeof(res->lat[0]), cmp_u32);
+
+	printf("%-5s %5u %6u %8lu %8.3f %7.3f %7u %7u %7u",
+		mode_names[mode], order, pkt_size, num_pkts,
+		num_pkts/secs/1e6, (double)num_pkts*pkt_size/secs/1e9,
+		res->lat[res->nlat*50/100], res->lat[res->nlat*99/100],
+		res->lat[res->nlat*999/1000]);
+	print_count(res->tx_count[0]);
+	print_count(res->rx_count[0]);
+	print_count(res->tx_count[1]);
+	print_count(res->rx_count[1]);
+	printf("\n");
+	fflush(stdout);
+	return 0;
+}
+
+static int parse_list(char *arg, unsigned int *v, int max)
+{
+	int n = 0;
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok && n < max; tok = strtok(NULL, ","))
+		v[n++] = strtoul(tok, NULL, 0);
+	return n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-m idx|idxn|pkt|all] [-o order,...] [-s size,...]\n"
+		"          [-n packets] [-l latency samples] [-p tx_cpu] [-c rx_cpu]\n"
+		"  ring orders default to 7..%d, sizes to 64B..64KB;\n"
+		"  combinations whose packet does not fit the ring are skipped\n",
+		prog, XENLOOP_ENTRY_ORDER);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int orders[16] = { 7, 8, 9, 10, 11, 12 };
+	unsigned int sizes[32] = { 64, 128, 256, 512, 1024, 1500, 4096, 9000, 16384, 32768, 65536 };
+	int norders = 6, nsizes = 11;
+	int modes = (1 << MODE_IDX) | (1 << MODE_IDXN) | (1 << MODE_PKT);
+	unsigned long max_pkts = 1000000;
+	int c, i, j, ret = 0;
+
+	while ((c = getopt(argc, argv, "m:o:s:n:l:p:c:")) != -1) {
+		switch (c) {
+		case 'm':
+			if (!strcmp(optarg, "all"))
+				break;
+			for (modes = 0, i = 0; i <= MODE_PKT; i++)
+				if (!strcmp(optarg, mode_names[i]))
+					modes = 1 << i;
+			if (!modes)
+				usage(argv[0]);
+			break;
+		case 'o':
+			norders = parse_list(optarg, orders, 16);
+			break;
+		case 's':
+			nsizes = parse_list(optarg, sizes, 32);
+			break;
+		case 'n':
+			max_pkts = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			nlat_pkts = strtoul(optarg, NULL, 0);
+			if (nlat_pkts > LAT_SAMPLES || nlat_pkts == 0)
+				usage(argv[0]);
+			break;
+		case 'p':
+			tx_cpu = atoi(optarg);
+			break;
+		case 'c':
+			rx_cpu = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	single_cpu = (sysconf(_SC_NPROCESSORS_ONLN) == 1);
+
+	res = mmap(NULL, sizeof(*res), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (res == MAP_FAILED || xu_init(XU_MAX_PAGES) < 0)
+		return 1;
+
+	printf("# latency in ns; llc = LLC read misses/pkt, brm = branch misses/pkt\n");
+	printf("%-5s %5s %6s %8s %8s %7s %7s %7s %7s %8s %8s %8s %8s\n",
+		"mode", "order", "size", "pkts", "Mpps", "GB/s", "p50", "p99", "p999",
+		"llc-tx", "llc-rx", "brm-tx", "brm-rx");
+
+	for (mode = 0; mode <= MODE_PKT; mode++) {
+		if (!(modes & (1 << mode)))
+			continue;
+		for (i = 0; i < norders; i++) {
+			for (j = 0; j < nsizes; j++) {
+				pkt_size = sizes[j];
+				if (mode == MODE_IDX && j > 0)
+					break;
+				if (mode == MODE_IDX)
+					pkt_size = sizeof(bf_data_t);
+				if (orders[i] > XENLOOP_ENTRY_ORDER ||
+				    pkt_size < sizeof(uint32_t) ||
+				    BF_PKT_ENTRIES(pkt_size) >= (1 << orders[i]))
+					continue;
+				num_pkts = max_pkts;
+				if (num_pkts > MAX_PKT_BYTES/pkt_size)
+					num_pkts = MAX_PKT_BYTES/pkt_size;
+				if (run_one(orders[i]) < 0)
+					ret = 1;
+			}
+		}
+	}
+
+	return ret;
+}
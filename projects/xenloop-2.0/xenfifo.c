@@ -36,96 +36,339 @@
 #include "xenfifo.h"
 
 /*
- * Create a listener-end of FIFO to which a remote domain can connect
- *	Called by the listener end of FIFO
- *	
- * @remote_domid - remote domain  allowed to connect
- * @entry_size - size of each entry in FIFO
- * @entry_order - maximum size of FIFO as a  power of 2. Current max 256. Max maxsize = 2^16.
- *
- * Returns: pointer to the shared FIFO struct
+ * Idle listener FIFOs, kept with their pages, mappings and grant 
+ * references so that the next xf_create of the same size only has to
+ * re-grant them. A FIFO goes back to the domain it last served as it 
+ * is; one that moves to another domain is cleared first.
  */
-xf_handle_t *xf_create(domid_t remote_domid, unsigned int entry_size, unsigned int entry_order)
+#define XF_POOL_PAGES 2048 	/* at most 8MB of idle FIFOs */
+
+static DEFINE_SPINLOCK(xf_pool_lock);
+static xf_handle_t *xf_pool;
+static int xf_pool_pages;
+
+/*
+ * Where the grant reference of FIFO page i is published
+ */
+static int *xf_gref_slot(xf_handle_t *xfl, int i)
+{
+	if (!xf_indirect(xfl->fifo_pages))
+		return &xfl->descriptor->grefs[i];
+
+	return &xfl->indirect[i / XF_GREFS_PER_PAGE][i % XF_GREFS_PER_PAGE];
+}
+
+/*
+ * Revoke a grant. Returns 0 if the peer still maps the page: the
+ * reference and the page are then leaked, as reusing either would hand
+ * the peer someone else's data.
+ */
+static int xf_end_grant(int ref)
+{
+	if (ref <= 0)
+		return 1;
+	if (!gnttab_end_foreign_access_ref(ref)) {
+		EPRINTK("gref %d still mapped, leaking its page\n", ref);
+		return 0;
+	}
+	gnttab_free_grant_reference(ref);
+	return 1;
+}
+
+/*
+ * Undo xf_create, however far it got. A zero gref was never granted.
+ * The references are our own copies: the peer can write the descriptor.
+ */
+static void xf_release(xf_handle_t *xfl)
 {
-	unsigned long page_order = get_order(entry_size*(1<<entry_order));
-	xf_handle_t * xfl = NULL;
 	int i;
 
-	TRACE_ENTRY;
+	if (xfl->grefs) {
+		for (i = 0; i < xfl->fifo_pages; i++)
+			if (!xf_end_grant(xfl->grefs[i]) && xfl->pages)
+				xfl->pages[i] = NULL;
+		kfree(xfl->grefs);
+	}
+	for (i = 0; i < XF_MAX_INDIRECT; i++)
+		if (!xf_end_grant(xfl->igrefs[i]))
+			xfl->indirect[i] = NULL;
+	if (!xf_end_grant(xfl->dgref))
+		xfl->descriptor = NULL;
+
+	if (xfl->fifo)
+		vunmap(xfl->fifo);
+
+	for (i = 0; i < XF_MAX_INDIRECT; i++)
+		if (xfl->indirect[i])
+			free_page((unsigned long)xfl->indirect[i]);
+
+	if (xfl->pages) {
+		for (i = 0; i < xfl->fifo_pages; i++)
+			if (xfl->pages[i])
+				__free_page(xfl->pages[i]);
+		kfree(xfl->pages);
+	}
 
-	if (entry_order > 16) {
-		EPRINTK("More than 64K entries requested\n");
-		goto err;
+	if (xfl->descriptor)
+		free_page((unsigned long)xfl->descriptor);
+	kfree(xfl);
+}
+
+/*
+ * Grant a reference to frame, reusing the one in *ref if the FIFO 
+ * came from the pool.
+ */
+static int xf_grant(int *ref, domid_t remote_domid, unsigned long frame, int readonly)
+{
+	if (*ref > 0)
+		gnttab_grant_foreign_access_ref(*ref, remote_domid, frame, readonly);
+	else
+		*ref = gnttab_grant_foreign_access(remote_domid, frame, readonly);
+
+	return *ref;
+}
+
+/*
+ * Take an idle FIFO of num_pages pages from the pool, preferring one
+ * that last served remote_domid.
+ */
+static xf_handle_t *xf_pool_get(domid_t remote_domid, int num_pages)
+{
+	xf_handle_t **p, **found = NULL;
+	xf_handle_t *xfl = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&xf_pool_lock, flags);
+	for (p = &xf_pool; *p; p = &(*p)->next) {
+		if ((*p)->fifo_pages != num_pages)
+			continue;
+		if (!found || (*p)->remote_id == remote_domid)
+			found = p;
+		if ((*p)->remote_id == remote_domid)
+			break;
+	}
+	if (found) {
+		xfl = *found;
+		*found = xfl->next;
+		xf_pool_pages -= num_pages;
 	}
+	spin_unlock_irqrestore(&xf_pool_lock, flags);
 
-	if( sizeof(xf_descriptor_t) > PAGE_SIZE) 
-		BUG(); 
+	return xfl;
+}
 
-	
-	if( page_order > MAX_FIFO_PAGE_ORDER) {
-		EPRINTK("%d > 2^MAX_PAGE_ORDER pages requested for FIFO\n", 1<<page_order);
-		goto err;
+/*
+ * Revoke the peer's access and keep the FIFO for reuse. Returns 0 if
+ * the pool is full or the peer still maps a page, in which case the 
+ * FIFO must be released instead, leaking the pages still mapped.
+ */
+static int xf_pool_put(xf_handle_t *xfl)
+{
+	unsigned long flags;
+	int i, busy = 0;
+
+	if (xf_pool_pages + xfl->fifo_pages > XF_POOL_PAGES)
+		return 0;
+
+	for (i = 0; i < xfl->fifo_pages; i++)
+		busy |= !gnttab_end_foreign_access_ref(xfl->grefs[i]);
+	for (i = 0; i < XF_INDIRECT_PAGES(xfl->fifo_pages) && xf_indirect(xfl->fifo_pages); i++)
+		busy |= !gnttab_end_foreign_access_ref(xfl->igrefs[i]);
+	busy |= !gnttab_end_foreign_access_ref(xfl->dgref);
+	if (busy)
+		return 0;
+
+	spin_lock_irqsave(&xf_pool_lock, flags);
+	if (xf_pool_pages + xfl->fifo_pages > XF_POOL_PAGES) {
+		spin_unlock_irqrestore(&xf_pool_lock, flags);
+		return 0;
 	}
+	xfl->next = xf_pool;
+	xf_pool = xfl;
+	xf_pool_pages += xfl->fifo_pages;
+	spin_unlock_irqrestore(&xf_pool_lock, flags);
+
+	return 1;
+}
+
+/*
+ * Free the pooled FIFOs. Call on module unload, once no FIFO is in use.
+ */
+void xf_pool_drain(void)
+{
+	xf_handle_t *xfl;
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock_irqsave(&xf_pool_lock, flags);
+		if ((xfl = xf_pool)) {
+			xf_pool = xfl->next;
+			xf_pool_pages -= xfl->fifo_pages;
+		}
+		spin_unlock_irqrestore(&xf_pool_lock, flags);
+		if (!xfl)
+			break;
+		xf_release(xfl);
+	}
+}
+
+/*
+ * Allocate the pages of a new listener FIFO and map them together with
+ * vmap, since a 16MB FIFO is far beyond what the buddy allocator hands out.
+ */
+static xf_handle_t *xf_alloc(int num_pages)
+{
+	xf_handle_t *xfl;
+	int i;
 
 	xfl = kmalloc(sizeof(xf_handle_t), GFP_KERNEL);
 	if(!xfl) {
 		EPRINTK("Out of memory\n");
-		goto err;
+		return NULL;
 	}
 	memset(xfl, 0, sizeof(xf_handle_t));
+	xfl->fifo_pages = num_pages;
 
-	
 	xfl->descriptor = (xf_descriptor_t *) __get_free_page(GFP_KERNEL);
 	if(!xfl->descriptor) {
 		EPRINTK("Cannot allocate descriptor memory page for FIFO\n");
 		goto err;
 	}
 
-	xfl->fifo = (void *) __get_free_pages(GFP_KERNEL,page_order);
+	xfl->pages = kmalloc(num_pages*sizeof(struct page *), GFP_KERNEL);
+	xfl->grefs = kmalloc(num_pages*sizeof(int), GFP_KERNEL);
+	if(!xfl->pages || !xfl->grefs) {
+		EPRINTK("Out of memory\n");
+		goto err;
+	}
+	memset(xfl->pages, 0, num_pages*sizeof(struct page *));
+	memset(xfl->grefs, 0, num_pages*sizeof(int));
+
+	for( i=0; i < num_pages; i++) {
+		xfl->pages[i] = alloc_page(GFP_KERNEL);
+		if(!xfl->pages[i]) {
+			EPRINTK("Cannot allocate buffer memory pages for FIFO\n");
+			goto err;
+		}
+	}
+
+	if (xf_indirect(num_pages)) {
+		for( i=0; i < XF_INDIRECT_PAGES(num_pages); i++) {
+			xfl->indirect[i] = (int *) get_zeroed_page(GFP_KERNEL);
+			if(!xfl->indirect[i]) {
+				EPRINTK("Cannot allocate indirect page for FIFO\n");
+				goto err;
+			}
+		}
+	}
+
+	xfl->fifo = vmap(xfl->pages, num_pages, VM_MAP, PAGE_KERNEL);
 	if(!xfl->fifo) {
-		EPRINTK("Cannot allocate buffer memory pages for FIFO\n");
+		EPRINTK("Cannot map %d FIFO pages\n", num_pages);
 		goto err;
 	}
 
-	
-	xfl->listen_flag = 1;
-	xfl->remote_id = remote_domid;
-	xfl->descriptor->suspended_flag = 0;
-	xfl->descriptor->num_pages = (1<<page_order);
-	xfl->descriptor->max_data_entries = (1<<entry_order);
-	xfl->descriptor->index_mask = ~(0xffffffff<<entry_order);
-	xfl->descriptor->front = xfl->descriptor->back = 0;
-
-	xfl->descriptor->dgref = gnttab_grant_foreign_access(remote_domid, virt_to_mfn(xfl->descriptor), 0);
-	if ( xfl->descriptor->dgref < 0) {
-		EPRINTK("Cannot share descriptor gref page %p\n", xfl->descriptor);
+	return xfl;
+
+err:
+	xf_release(xfl);
+	return NULL;
+}
+
+/*
+ * Create a listener-end of FIFO to which a remote domain can connect
+ *	Called by the listener end of FIFO
+ *	
+ * @remote_domid - remote domain  allowed to connect
+ * @entry_size - size of each entry in FIFO
+ * @entry_order - maximum size of FIFO as a power of 2, up to
+ * 	MAX_FIFO_PAGES pages in all.
+ *
+ * Returns: pointer to the shared FIFO struct
+ */
+xf_handle_t *xf_create(domid_t remote_domid, unsigned int entry_size, unsigned int entry_order)
+{
+	unsigned long page_order;
+	xf_handle_t * xfl = NULL;
+	xf_descriptor_t *des;
+	int i, num_pages;
+
+	TRACE_ENTRY;
+
+	if( sizeof(xf_descriptor_t) > PAGE_SIZE) 
+		BUG(); 
+
+	if (entry_order > 24) {
+		EPRINTK("More than 16M entries requested\n");
 		goto err;
 	}
 
-	for( i=0; i < xfl->descriptor->num_pages; i++) {
+	page_order = get_order(entry_size*(1<<entry_order));
+	if( page_order > MAX_FIFO_PAGE_ORDER) {
+		EPRINTK("%d > 2^MAX_PAGE_ORDER pages requested for FIFO\n", 1<<page_order);
+		goto err;
+	}
+	num_pages = 1<<page_order;
+
+	xfl = xf_pool_get(remote_domid, num_pages);
+	if (xfl) {
+		/* Do not show one domain what another sent */
+		if (xfl->remote_id != remote_domid)
+			memset(xfl->fifo, 0, num_pages*PAGE_SIZE);
+	} else {
+		xfl = xf_alloc(num_pages);
+		if (!xfl)
+			goto err;
+	}
 
-		xfl->descriptor->grefs[i] = 
-				gnttab_grant_foreign_access(remote_domid, 
-						virt_to_mfn(((uint8_t *)xfl->fifo) + i*PAGE_SIZE), 0);
+	des = xfl->descriptor;
+	memset(des, 0, PAGE_SIZE);
+	des->num_pages = num_pages;
 
-		if ( xfl->descriptor->grefs[i] < 0) {
+	xfl->listen_flag = 1;
+	xfl->remote_id = remote_domid;
+	des->version = XF_VERSION;
+	des->suspended_flag = 0;
+	des->max_data_entries = xfl->max_data_entries = (1<<entry_order);
+	des->index_mask = xfl->index_mask = ~(0xffffffff<<entry_order);
+	des->front = des->back = 0;
+	des->back_event = 1;
+	xfl->front_cache = xfl->back_cache = 0;
+	xfl->back_notified = 0;
+	xfl->front_notified = 0;
+
+	for( i=0; i < num_pages; i++) {
+		if (xf_grant(&xfl->grefs[i], remote_domid, 
+				pfn_to_mfn(page_to_pfn(xfl->pages[i])), 0) < 0) {
 			EPRINTK("Cannot share FIFO %p page %d\n", xfl->fifo, i);
-			while(--i) gnttab_end_foreign_access(xfl->descriptor->grefs[i], 0);
-			gnttab_end_foreign_access(xfl->descriptor->dgref, 0);
-			goto err;
+			goto err_release;
+		}
+		*xf_gref_slot(xfl, i) = xfl->grefs[i];
+	}
+
+	if (xf_indirect(num_pages)) {
+		for( i=0; i < XF_INDIRECT_PAGES(num_pages); i++) {
+			if (xf_grant(&xfl->igrefs[i], remote_domid, 
+					virt_to_mfn(xfl->indirect[i]), 1) < 0) {
+				EPRINTK("Cannot share FIFO indirect page %d\n", i);
+				goto err_release;
+			}
+			des->grefs[i] = xfl->igrefs[i];
 		}
 	}
 
+	if (xf_grant(&xfl->dgref, remote_domid, virt_to_mfn(des), 0) < 0) {
+		EPRINTK("Cannot share descriptor gref page %p\n", des);
+		goto err_release;
+	}
+	des->dgref = xfl->dgref;
+
 	TRACE_EXIT;
 	return xfl;
 
+err_release:
+	xf_release(xfl);
 err:
-	if( xfl) {
-		if( xfl->descriptor) free_page((unsigned long)xfl->descriptor);
-		if( xfl->fifo ) free_pages((unsigned long)xfl->fifo, page_order);
-		kfree(xfl);
-	}
-
 	TRACE_ERROR;
 	return NULL;
 }
@@ -138,7 +381,6 @@ err:
  */
 int xf_destroy(xf_handle_t *xfl)
 {
-	int i;
 	TRACE_ENTRY;
 
 	if(!xfl || !xfl->descriptor || !xfl->fifo) {
@@ -146,12 +388,8 @@ int xf_destroy(xf_handle_t *xfl)
 		goto err;
 	}
 
-	for(i=0; i < xfl->descriptor->num_pages; i++) 
-		gnttab_end_foreign_access(xfl->descriptor->grefs[i], 0);
-	gnttab_end_foreign_access(xfl->descriptor->dgref, 0);
-
-	free_pages((unsigned long)xfl->fifo, get_order(xfl->descriptor->num_pages*PAGE_SIZE));
-	free_page((unsigned long)xfl->descriptor);
+	if (!xf_pool_put(xfl))
+		xf_release(xfl);
 
 	TRACE_EXIT;
 	return 0;
@@ -161,17 +399,170 @@ err:
 	return -1;
 }
 
+/*
+ * Does the connector still map a page of the FIFO? Its pages must not
+ * be freed or pooled until it does not.
+ */
+int xf_mapped(xf_handle_t *xfl)
+{
+	int i;
+
+	for (i = 0; i < xfl->fifo_pages; i++)
+		if (xfl->grefs[i] > 0 && gnttab_query_foreign_access(xfl->grefs[i]))
+			return 1;
+	for (i = 0; i < XF_MAX_INDIRECT; i++)
+		if (xfl->igrefs[i] > 0 && gnttab_query_foreign_access(xfl->igrefs[i]))
+			return 1;
+
+	return gnttab_query_foreign_access(xfl->dgref) != 0;
+}
+
+
+/*
+ * Grant map and unmap operations go to the hypervisor XF_MAP_BATCH 
+ * at a time, so that all of a FIFO of up to 2MB takes one hypercall, 
+ * without a large allocation for the operation array.
+ */
+#define XF_MAP_BATCH 512
+
+/*
+ * Unmap n pages mapped at addr by xf_map_pages
+ */
+static void xf_unmap_pages(void *addr, grant_handle_t *handles, int n, uint32_t flags)
+{
+	gnttab_unmap_grant_ref_t *unmap_ops, unmap_op;
+	int i, j, k, ret;
+
+	unmap_ops = kmalloc(min(n, XF_MAP_BATCH)*sizeof(*unmap_ops), GFP_KERNEL);
+
+	for(i=0; i < n; i += k) {
+		/* Out of memory or not, the pages must not stay mapped */
+		if (!unmap_ops) {
+			gnttab_set_unmap_op(&unmap_op, (unsigned long)addr + i*PAGE_SIZE, 
+					flags, handles[i]);
+			ret = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap_op, 1);
+			if( ret || unmap_op.status != GNTST_okay )
+				EPRINTK("HYPERVISOR_grant_table_op unmap failed ret = %d status = %d\n", 
+					ret, unmap_op.status);
+			k = 1;
+			continue;
+		}
+
+		k = min(n - i, XF_MAP_BATCH);
+		for(j=0; j < k; j++)
+			gnttab_set_unmap_op(&unmap_ops[j], (unsigned long)addr + (i+j)*PAGE_SIZE, 
+					flags, handles[i+j]);
+		ret = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, unmap_ops, k);
+		if( ret )
+			EPRINTK("HYPERVISOR_grant_table_op unmap failed ret = %d \n", ret);
+		for(j=0; j < k; j++)
+			if( unmap_ops[j].status != GNTST_okay )
+				EPRINTK("unmap of page %d failed status = %d\n", i+j, unmap_ops[j].status);
+	}
+
+	kfree(unmap_ops);
+}
+
+/*
+ * Map n pages granted by remote_domid at addr. If any of them fails, 
+ * unmaps all that were mapped and returns -1.
+ */
+static int xf_map_pages(void *addr, int *grefs, grant_handle_t *handles, int n, 
+			uint32_t flags, domid_t remote_domid)
+{
+	gnttab_map_grant_ref_t *map_ops;
+	int i, j, k, ret, bad = 0;
+
+	map_ops = kmalloc(min(n, XF_MAP_BATCH)*sizeof(*map_ops), GFP_KERNEL);
+	if (!map_ops) {
+		EPRINTK("Out of memory\n");
+		return -1;
+	}
+
+	for(i=0; i < n; i += k) {
+		k = min(n - i, XF_MAP_BATCH);
+		for(j=0; j < k; j++) {
+			gnttab_set_map_op(&map_ops[j], (unsigned long)addr + (i+j)*PAGE_SIZE, 
+					flags, grefs[i+j], remote_domid);
+			/* An entry the hypervisor never got to must not look mapped */
+			map_ops[j].status = GNTST_general_error;
+		}
+
+		ret = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, map_ops, k);
+		if( ret )
+			EPRINTK("HYPERVISOR_grant_table_op failed ret = %d\n", ret);
+
+		/* Keep the mapped ones at the front, ready to be unmapped */
+		for(j=0; j < k; j++) {
+			if( map_ops[j].status != GNTST_okay ) {
+				if (!bad++)
+					EPRINTK("map of page %d failed status = %d\n", i+j, map_ops[j].status);
+				continue;
+			}
+			handles[i+j-bad] = map_ops[j].handle;
+			if (bad)
+				map_ops[j-bad] = map_ops[j];
+		}
+
+		if (bad) {
+			for(j=0; j < k - bad; j++)
+				xf_unmap_pages((void *)(unsigned long)map_ops[j].host_addr, 
+					&handles[i+j], 1, flags);
+			xf_unmap_pages(addr, handles, i, flags);
+			kfree(map_ops);
+			return -1;
+		}
+	}
+
+	kfree(map_ops);
+	return 0;
+}
+
+/*
+ * Map the FIFO pages. Large FIFOs list their grefs in indirect pages, 
+ * which are needed only for as long as it takes to read them.
+ */
+static int xf_map_fifo(xf_handle_t *xfc, int *grefs, int num_pages)
+{
+	grant_handle_t ihandles[XF_MAX_INDIRECT];
+	struct vm_struct *iarea = NULL;
+	int ind = 0, ret;
+
+	if (xf_indirect(num_pages)) {
+		ind = XF_INDIRECT_PAGES(num_pages);
+		iarea = alloc_vm_area(ind*PAGE_SIZE);
+		if (!iarea) {
+			EPRINTK("error: cannot allocate memory for indirect pages\n");
+			return -1;
+		}
+		if (xf_map_pages(iarea->addr, grefs, ihandles, ind, 
+				GNTMAP_host_map | GNTMAP_readonly, xfc->remote_id) < 0) {
+			free_vm_area(iarea);
+			return -1;
+		}
+		grefs = iarea->addr;
+	}
+
+	ret = xf_map_pages(xfc->fifo, grefs, xfc->fhandles, num_pages, 
+			GNTMAP_host_map, xfc->remote_id);
+
+	if (iarea) {
+		xf_unmap_pages(iarea->addr, ihandles, ind, GNTMAP_host_map | GNTMAP_readonly);
+		free_vm_area(iarea);
+	}
+
+	return ret;
+}
 
 /*
  * Connect to a FIFO listener on another domain
  */
 
-xf_handle_t *xf_connect(domid_t remote_domid, int remote_gref)
+xf_handle_t *xf_connect(domid_t remote_domid, int remote_gref, unsigned int entry_size)
 {
 	xf_handle_t *xfc = NULL;
-	gnttab_map_grant_ref_t map_op;
-	int ret;
-	int i;
+	uint32_t max, mask;
+	int num_pages;
 	TRACE_ENTRY;
 
 	xfc = kmalloc(sizeof(xf_handle_t), GFP_KERNEL);
@@ -182,67 +573,67 @@ xf_handle_t *xf_connect(domid_t remote_domid, int remote_gref)
 	memset(xfc, 0, sizeof(xf_handle_t));
 
 	xfc->descriptor_vmarea = alloc_vm_area(PAGE_SIZE);
-	xfc->fifo_vmarea = alloc_vm_area( MAX_FIFO_PAGES*PAGE_SIZE );
-	if(!xfc->descriptor_vmarea || !xfc->fifo_vmarea) {
-		EPRINTK("error: cannot allocate memory for descriptor OR FIFO\n");
+	if(!xfc->descriptor_vmarea) {
+		EPRINTK("error: cannot allocate memory for descriptor\n");
 		goto err;
 	}
 
-	gnttab_set_map_op(&map_op, (unsigned long)xfc->descriptor_vmarea->addr, 
-				GNTMAP_host_map, remote_gref, remote_domid);
-	ret = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &map_op, 1);
-	if( ret || (map_op.status != GNTST_okay) ) {
-		EPRINTK("HYPERVISOR_grant_table_op failed ret = %d status = %d\n", ret, map_op.status);
+	if (xf_map_pages(xfc->descriptor_vmarea->addr, &remote_gref, &xfc->dhandle, 1, 
+			GNTMAP_host_map, remote_domid) < 0)
 		goto err;
-	}
 
 	xfc->listen_flag = 0; 
 	xfc->remote_id = remote_domid;
 	xfc->descriptor = xfc->descriptor_vmarea->addr;
-	xfc->fifo = xfc->fifo_vmarea->addr;
-	xfc->dhandle = map_op.handle;
-
-	for(i=0; i < xfc->descriptor->num_pages; i++) {
-
-		gnttab_set_map_op(&map_op, 
-				(unsigned long)(xfc->fifo_vmarea->addr + i*PAGE_SIZE), 
-				GNTMAP_host_map, xfc->descriptor->grefs[i], remote_domid);
-
-		ret = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &map_op, 1);
 
-		if( ret || (map_op.status != GNTST_okay) ) {
-			gnttab_unmap_grant_ref_t unmap_op;
-
-			EPRINTK("HYPERVISOR_grant_table_op failed ret = %d status = %d\n", ret, map_op.status);
-			while(--i >= 0) {
-				gnttab_set_unmap_op(&unmap_op, 
-					(unsigned long)xfc->fifo_vmarea->addr + i*PAGE_SIZE, 
-					GNTMAP_host_map, xfc->fhandles[i]);
-				ret = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap_op, 1);
-				if( ret )
-					EPRINTK("HYPERVISOR_grant_table_op unmap failed ret = %d \n", ret);
-			}
-
-			gnttab_set_unmap_op(&unmap_op, 
-				(unsigned long)xfc->descriptor_vmarea->addr, 
-				GNTMAP_host_map, xfc->dhandle);
-			ret = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap_op, 1);
-			if( ret )
-				EPRINTK("HYPERVISOR_grant_table_op unmap failed ret = %d \n", ret);
+	/* 
+	 * The listener could change these later, so keep our own copies, 
+	 * and check that the entries fit in the pages we are going to map
+	 */
+	num_pages = xfc->descriptor->num_pages;
+	max = xfc->descriptor->max_data_entries;
+	mask = xfc->descriptor->index_mask;
+	if (xfc->descriptor->version != XF_VERSION || num_pages < 1 || num_pages > MAX_FIFO_PAGES) {
+		EPRINTK("Incompatible FIFO descriptor version %x (expected %x) num_pages %d\n", 
+			xfc->descriptor->version, XF_VERSION, num_pages);
+		goto err_unmap;
+	}
+	if (!max || (max & (max - 1)) || mask != max - 1 || 
+	    max > num_pages*(PAGE_SIZE/entry_size)) {
+		EPRINTK("Bad FIFO descriptor: %u entries, mask %x, %d pages\n", 
+			max, mask, num_pages);
+		goto err_unmap;
+	}
+	xfc->max_data_entries = max;
+	xfc->index_mask = mask;
+
+	xfc->fhandles = kmalloc(num_pages*sizeof(grant_handle_t), GFP_KERNEL);
+	xfc->fifo_vmarea = alloc_vm_area(num_pages*PAGE_SIZE);
+	if(!xfc->fhandles || !xfc->fifo_vmarea) {
+		EPRINTK("error: cannot allocate memory for FIFO\n");
+		goto err_unmap;
+	}
+	xfc->fifo = xfc->fifo_vmarea->addr;
+	xfc->fifo_pages = num_pages;
 
-			goto err;
-		}
+	xfc->front_cache = xfc->descriptor->front;
+	xfc->back_cache = xfc->descriptor->back;
+	xfc->back_notified = xfc->descriptor->back;
+	xfc->front_notified = xfc->descriptor->front;
 
-		xfc->fhandles[i] = map_op.handle;
-	}
+	if (xf_map_fifo(xfc, xfc->descriptor->grefs, num_pages) < 0)
+		goto err_unmap;
 
 	TRACE_EXIT;
 	return xfc;
 
+err_unmap:
+	xf_unmap_pages(xfc->descriptor_vmarea->addr, &xfc->dhandle, 1, GNTMAP_host_map);
 err:
 	if(xfc) {
 		if(xfc->fifo_vmarea) free_vm_area(xfc->fifo_vmarea);
 		if(xfc->descriptor_vmarea) free_vm_area(xfc->descriptor_vmarea);
+		kfree(xfc->fhandles);
 		kfree(xfc);
 	}
 	TRACE_ERROR;
@@ -251,8 +642,6 @@ err:
 
 int xf_disconnect(xf_handle_t *xfc)
 {
-	gnttab_unmap_grant_ref_t unmap_op;
-	int i, num_pages, ret;
 	TRACE_ENTRY;
 
 	if(!xfc || !xfc->descriptor_vmarea || !xfc->descriptor || !xfc->fifo_vmarea || !xfc->fifo) {
@@ -260,24 +649,13 @@ int xf_disconnect(xf_handle_t *xfc)
 		goto err;
 	}
 
-	num_pages = xfc->descriptor->num_pages;
-	for(i=0; i < num_pages; i++) {
-		gnttab_set_unmap_op(&unmap_op, (unsigned long)(xfc->fifo_vmarea->addr + i*PAGE_SIZE), 
-			GNTMAP_host_map, xfc->fhandles[i]);
-		ret = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap_op, 1);
-		if( ret )
-			EPRINTK("HYPERVISOR_grant_table_op unmap failed ret = %d \n", ret);
-	}
-
-	gnttab_set_unmap_op(&unmap_op, (unsigned long)xfc->descriptor_vmarea->addr, 
-			GNTMAP_host_map, xfc->dhandle);
-	ret = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &unmap_op, 1);
-	if( ret )
-		EPRINTK("HYPERVISOR_grant_table_op unmap failed ret = %d \n", ret);
+	xf_unmap_pages(xfc->fifo, xfc->fhandles, xfc->fifo_pages, GNTMAP_host_map);
+	xf_unmap_pages(xfc->descriptor_vmarea->addr, &xfc->dhandle, 1, GNTMAP_host_map);
 
 	free_vm_area(xfc->descriptor_vmarea);
 	free_vm_area(xfc->fifo_vmarea);
 
+	kfree(xfc->fhandles);
 	kfree(xfc);
 
 	TRACE_EXIT;
@@ -287,4 +665,3 @@ err:
 	TRACE_ERROR;
 	return -1;
 }
-
@@ -36,36 +36,80 @@
 #ifndef _XENFIFO_H_
 #define _XENFIFO_H_
 
+#ifdef XENLOOP_USER
+#include "user/xen_user.h"
+#else
 #include <xen/xenbus.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mm.h>
+#include <linux/vmalloc.h>
 
 #include <xen/hypercall.h>
 #include <xen/driver_util.h>
 #include <xen/gnttab.h>
 #include <xen/evtchn.h>
+#endif
 
 #include "debug.h"
 
-#define MAX_FIFO_PAGES 64
-#define MAX_FIFO_PAGE_ORDER 6  
+#define MAX_FIFO_PAGES 4096 	/* 16MB */
+#define MAX_FIFO_PAGE_ORDER 12
+
+/*
+ * Up to XF_DIRECT_PAGES FIFO pages are granted straight from the 
+ * descriptor. Larger FIFOs list their grant references in indirect 
+ * pages, XF_GREFS_PER_PAGE to a page, and the descriptor grants those.
+ */
+#define XF_DIRECT_PAGES 64
+#define XF_GREFS_PER_PAGE (PAGE_SIZE/sizeof(int))
+#define XF_INDIRECT_PAGES(n) (((n) + XF_GREFS_PER_PAGE - 1)/XF_GREFS_PER_PAGE)
+#define XF_MAX_INDIRECT XF_INDIRECT_PAGES(MAX_FIFO_PAGES)
+#define xf_indirect(num_pages) ((num_pages) > XF_DIRECT_PAGES)
+
+/*
+ * Layout version of the shared descriptor and of the records in the
+ * FIFO. Peers with a different version refuse to connect. The low
+ * byte is non-zero so that a version 1 peer, which expects
+ * suspended_flag at offset 0, sees the channel as suspended and
+ * backs off.
+ */
+#define XF_VERSION 0x58460009 	/* "XF" v9 */
+
+/*
+ * Both guests run on the same host, so this is a property of the
+ * protocol rather than of either guest's kernel configuration.
+ */
+#define XF_CACHE_BYTES 64
+#define __xf_cacheline_aligned __attribute__((__aligned__(XF_CACHE_BYTES)))
 
 /* 
  * Shared FIFO descriptor page 
  * 	sizeof(xf_descriptor_t) should be no bigger than PAGE_SIZE
+ *
+ * 	back and front_event are written only by the producer, front and 
+ * 	back_event only by the consumer, each pair on its own cache line, 
+ * 	so the two guests do not false-share.
+ * 	Everything before them is set up by xf_create and only read afterwards,
+ * 	apart from the rarely written suspended_flag.
  */
 struct xf_descriptor {
+	uint32_t version;
 	u8 suspended_flag;
 	unsigned int num_pages; 
-	int grefs[MAX_FIFO_PAGES]; /* grant references to FIFO pages -- Not too many 
-				      pages expected right now */
 	int dgref; 
-	uint16_t max_data_entries; /* Max 64K. Should be power of 2. */ 
-	uint32_t front, back; /* Range of these indices must be power of 2 
-				 and larger than max_data_entries.*/ 
+	uint32_t max_data_entries; /* Should be power of 2. */ 
 	uint32_t index_mask; 
-};
+	int grefs[XF_DIRECT_PAGES]; /* grant references to FIFO pages, or to the
+				       indirect pages that list them */
+
+	uint32_t back __xf_cacheline_aligned; /* Range of front and back must be power of 2 
+						 and larger than max_data_entries.*/ 
+	uint32_t front_event; 	/* producer wants a notification once front passes this */
+
+	uint32_t front __xf_cacheline_aligned;
+	uint32_t back_event; 	/* consumer wants a notification once back passes this */
+} __xf_cacheline_aligned;
 typedef struct xf_descriptor xf_descriptor_t;
 
 struct xf_handle {
@@ -76,44 +120,249 @@ struct xf_handle {
 	int listen_flag; 
 
 	
+	unsigned int fifo_pages; /* our own copy of num_pages */
+	uint32_t max_data_entries, index_mask; /* and of these, checked against it */
+	struct page **pages; 	/* listener: FIFO pages, mapped together at fifo */
+	int *indirect[XF_MAX_INDIRECT]; /* listener: indirect gref pages */
+	int *grefs, igrefs[XF_MAX_INDIRECT], dgref; /* listener: what we granted */
+	struct xf_handle *next; /* listener: in the pool of idle FIFOs */
+
 	struct vm_struct *descriptor_vmarea;
 	grant_handle_t dhandle; 
 	struct vm_struct *fifo_vmarea;
-	grant_handle_t fhandles[MAX_FIFO_PAGES]; 
-
+	grant_handle_t *fhandles; /* connector: one per FIFO page */
+
+	/* 
+	 * Local copies of the peer's index, so that the common case does not 
+	 * touch the peer's cache line. front_cache is used by the producer, 
+	 * back_cache by the consumer. Both only ever lag the real index.
+	 */
+	uint32_t front_cache;
+	uint32_t back_cache;
+
+	uint32_t back_notified; /* producer: back at the last xf_check_notify */
+	uint32_t front_notified; /* consumer: front at the last xf_check_space_notify */
 };
 typedef struct xf_handle xf_handle_t;
 
 /******************* Listener functions *********************************/
 extern xf_handle_t *xf_create(domid_t remote_domid, unsigned int entry_size, unsigned int entry_order);
 extern int xf_destroy(xf_handle_t *xfl);
+extern int xf_mapped(xf_handle_t *xfl);
+extern void xf_pool_drain(void);
 /******************* Connector functions *********************************/
-extern xf_handle_t *xf_connect(domid_t remote_domid, int remote_gref);
+extern xf_handle_t *xf_connect(domid_t remote_domid, int remote_gref, unsigned int entry_size);
 extern int xf_disconnect(xf_handle_t *xfc);
 
 /************** FUNCTIONS FOR BOTH LISTENER AND CONNECTOR ******************
- * Although it may be best if one side sticks to push/back and other to pop/front 
+ * One side must stick to push/back (producer) and the other to pop/front 
+ * (consumer): each side caches the other's index in its own handle.
+ *
+ * Ordering: the producer fills entries, then publishes back with release 
+ * semantics; the consumer reads back with acquire semantics before it 
+ * looks at the entries, and publishes front with release semantics once 
+ * it is done with them. The peer runs in another domain on another CPU 
+ * even in a UP guest, so these are the mandatory barriers, not smp_*().
+ * x86 never reorders a load with an older load or a store with any older 
+ * access, so there only the compiler needs to be held back.
  ****************************************************************************/
 
+#define XF_READ_ONCE(x) 	(*(volatile typeof(x) *)&(x))
+#define XF_WRITE_ONCE(x, val) 	(*(volatile typeof(x) *)&(x) = (val))
+
+#if defined(__i386__) || defined(__x86_64__)
+#define xf_mb() 	barrier()
+#else
+#define xf_mb() 	mb()
+#endif
+
+/* Read the peer's index; later reads and writes of entries stay after it */
+static inline uint32_t xf_load_acquire(uint32_t *index)
+{
+	uint32_t val = XF_READ_ONCE(*index);
+
+	xf_mb();
+	return val;
+}
+
+/* Publish our index; earlier reads and writes of entries stay before it */
+static inline void xf_store_release(uint32_t *index, uint32_t val)
+{
+	xf_mb();
+	XF_WRITE_ONCE(*index, val);
+}
+
+/*
+ * Exact number of entries in the FIFO. Reads both indices, so keep 
+ * it off the per-packet path.
+ */
 static inline uint32_t xf_size(xf_handle_t *h)
 {
-	return h->descriptor->back - h->descriptor->front;
+	return XF_READ_ONCE(h->descriptor->back) - XF_READ_ONCE(h->descriptor->front);
 }
 
 
 static inline uint32_t xf_free(xf_handle_t *h)
 {
-	return  h->descriptor->max_data_entries - xf_size(h);
+	return  h->max_data_entries - xf_size(h);
 }
 
+/*
+ * Producer: are there at least n free entries?
+ * Re-reads the consumer's front only when the cached copy says no.
+ */
+static inline int xf_has_free(xf_handle_t *h, uint32_t n)
+{
+	xf_descriptor_t *des = h->descriptor;
+
+	if( h->max_data_entries - (des->back - h->front_cache) >= n )
+		return 1;
+
+	h->front_cache = xf_load_acquire(&des->front);
+
+	return ( h->max_data_entries - (des->back - h->front_cache) >= n );
+}
+
+/*
+ * Consumer: are there at least n entries to read?
+ * Re-reads the producer's back only when the cached copy says no.
+ */
+static inline int xf_has_data(xf_handle_t *h, uint32_t n)
+{
+	xf_descriptor_t *des = h->descriptor;
+
+	if( h->back_cache - des->front >= n )
+		return 1;
+
+	h->back_cache = xf_load_acquire(&des->back);
+
+	return ( h->back_cache - des->front >= n );
+}
+
+/* Producer side */
 static inline int xf_full(xf_handle_t *h)
 {
-	return ( xf_size(h) == h->descriptor->max_data_entries );
+	return !xf_has_free(h, 1);
 }
 
+/* Consumer side */
 static inline int xf_empty(xf_handle_t *h)
 {
-	return ( xf_size(h) == 0 );
+	return !xf_has_data(h, 1);
+}
+
+/*
+ * Notification suppression, as in the Xen shared rings. 
+ * The consumer leaves back_event behind while it is draining the FIFO, 
+ * so the producer does not notify it, and sets it to front+1 when it is 
+ * about to wait. The producer notifies only if back has crossed 
+ * back_event since it last checked, i.e. once per empty to non-empty 
+ * transition that the consumer is waiting for. 
+ * Both sides need a full barrier between publishing their own index and 
+ * reading the other's, even on x86.
+ */
+
+/*
+ * Producer: call after pushing. Returns non-zero if the consumer 
+ * needs to be notified of the new entries.
+ */
+static inline int xf_check_notify(xf_handle_t *h)
+{
+	xf_descriptor_t *des = h->descriptor;
+	uint32_t old = h->back_notified;
+	uint32_t new = des->back;
+
+	if( new == old )
+		return 0;
+
+	h->back_notified = new;
+	mb();
+
+	return ( (uint32_t)(new - XF_READ_ONCE(des->back_event)) < (uint32_t)(new - old) );
+}
+
+/*
+ * Consumer: call when the FIFO looks empty and before waiting for a 
+ * notification. Returns non-zero if entries arrived in the meantime, 
+ * in which case the caller must keep consuming instead of waiting.
+ */
+static inline int xf_enable_notify(xf_handle_t *h)
+{
+	xf_descriptor_t *des = h->descriptor;
+
+	XF_WRITE_ONCE(des->back_event, des->front + 1);
+	mb();
+
+	return !xf_empty(h);
+}
+
+/*
+ * The same scheme in the other direction lets a producer that found the 
+ * FIFO full wait for room instead of polling: it sets front_event to the 
+ * front at which n entries will be free, and the consumer notifies it 
+ * once front crosses that point.
+ */
+
+/*
+ * Producer: call when the FIFO has no room for n entries and before 
+ * waiting for a notification. Returns non-zero if the room appeared in 
+ * the meantime, in which case the caller must retry instead of waiting.
+ */
+static inline int xf_request_space(xf_handle_t *h, uint32_t n)
+{
+	xf_descriptor_t *des = h->descriptor;
+
+	XF_WRITE_ONCE(des->front_event, des->back + n - h->max_data_entries);
+	mb();
+
+	return xf_has_free(h, n);
+}
+
+/*
+ * Producer: has the consumer popped everything before idx?
+ */
+static inline int xf_consumed(xf_handle_t *h, uint32_t idx)
+{
+	if( (int32_t)(h->front_cache - idx) >= 0 )
+		return 1;
+
+	h->front_cache = xf_load_acquire(&h->descriptor->front);
+
+	return ( (int32_t)(h->front_cache - idx) >= 0 );
+}
+
+/*
+ * Producer: ask for a notification once the consumer has popped 
+ * everything before idx. Returns non-zero if it already has, in which 
+ * case the caller must not wait for the notification.
+ */
+static inline int xf_request_front(xf_handle_t *h, uint32_t idx)
+{
+	xf_descriptor_t *des = h->descriptor;
+
+	XF_WRITE_ONCE(des->front_event, idx);
+	mb();
+
+	return xf_consumed(h, idx);
+}
+
+/*
+ * Consumer: call after popping. Returns non-zero if the producer is 
+ * waiting for the room just freed.
+ */
+static inline int xf_check_space_notify(xf_handle_t *h)
+{
+	xf_descriptor_t *des = h->descriptor;
+	uint32_t old = h->front_notified;
+	uint32_t new = des->front;
+
+	if( new == old )
+		return 0;
+
+	h->front_notified = new;
+	mb();
+
+	return ( (uint32_t)(new - XF_READ_ONCE(des->front_event)) < (uint32_t)(new - old) );
 }
 
 /*
@@ -128,7 +377,7 @@ static inline uint32_t xf_push(xf_handle_t *handle)
 		return -1;
 	}
 
-	des->back++; 
+	xf_store_release(&des->back, des->back + 1); 
 
 	return 0;
 }
@@ -141,11 +390,11 @@ static inline uint32_t xf_pushn(xf_handle_t *handle, uint32_t n)
 {
 	xf_descriptor_t *des = handle->descriptor;
 
-	if( xf_free(handle) < n ) {
+	if( !xf_has_free(handle, n) ) {
 		return -1;
 	}
 
-	des->back += n;
+	xf_store_release(&des->back, des->back + n);
 
 	return 0;
 }
@@ -162,11 +411,24 @@ static inline uint32_t xf_pop(xf_handle_t *handle)
 		return -1;
 	}
 
-	des->front++; 
+	xf_store_release(&des->front, des->front + 1); 
 
 	return 0;
 }
 
+/*
+ * Consumer: snapshot the producer's back once and return how many 
+ * entries past front can be read. A receiver can walk them with 
+ * xf_entry and release them all with one xf_popn, so that a batch 
+ * costs one read of back and one write of front.
+ */
+static inline uint32_t xf_front_batch(xf_handle_t *h)
+{
+	h->back_cache = xf_load_acquire(&h->descriptor->back);
+
+	return h->back_cache - h->descriptor->front;
+}
+
 /*
  * Remove n data values from the front of the FIFO. 
  * Returns value is 0 on success, -1 on failure
@@ -175,11 +437,11 @@ static inline uint32_t xf_popn(xf_handle_t *handle, uint32_t n)
 { 
 	xf_descriptor_t *des = handle->descriptor;
 
-	if( xf_size(handle) < n ) {
+	if( !xf_has_data(handle, n) ) {
 		return -1;
 	}
 
-	des->front += n; 
+	xf_store_release(&des->front, des->front + n); 
 
 	return 0;
 }
@@ -202,7 +464,7 @@ do									\
 		break;							\
 	}								\
 									\
-	_xf_ret = &_xf_fifo[_xf_des->back & _xf_des->index_mask];	\
+	_xf_ret = &_xf_fifo[_xf_des->back & handle->index_mask];	\
  									\
 } while (0);								\
 _xf_ret;								\
@@ -227,7 +489,7 @@ do									\
 		break;							\
 	}								\
 									\
-	_xf_ret = &_xf_fifo[_xf_des->front & _xf_des->index_mask];	\
+	_xf_ret = &_xf_fifo[_xf_des->front & handle->index_mask];	\
  									\
 } while (0);								\
 _xf_ret;								\
@@ -235,7 +497,7 @@ _xf_ret;								\
 )
 
 /*
- * Return pointer to entry at position index in FIFO
+ * Return pointer to entry at position index in FIFO, counted from front
  * Doesn't check if index is within front and back
  */
 #define xf_entry(handle, type, index) (					\
@@ -246,7 +508,26 @@ do									\
 	xf_descriptor_t *_xf_des = handle->descriptor;			\
 	type *_xf_fifo = (type *)handle->fifo;				\
 									\
-	_xf_ret = &_xf_fifo[ (_xf_des->front + index) & _xf_des->index_mask]; \
+	_xf_ret = &_xf_fifo[ (_xf_des->front + index) & handle->index_mask]; \
+ 									\
+} while (0);								\
+_xf_ret;								\
+}									\
+)
+
+/*
+ * Return pointer to the free entry at position index past back (producer side)
+ * Doesn't check if index is within the free space
+ */
+#define xf_back_entry(handle, type, index) (				\
+{ 									\
+type * _xf_ret;								\
+do									\
+{									\
+	xf_descriptor_t *_xf_des = handle->descriptor;			\
+	type *_xf_fifo = (type *)handle->fifo;				\
+									\
+	_xf_ret = &_xf_fifo[ (_xf_des->back + index) & handle->index_mask]; \
  									\
 } while (0);								\
 _xf_ret;								\